@@ -1,19 +1,79 @@
+class ASTWriter;
+
+
 namespace{
 
 
+enum ExprType {
+    type_double,
+    type_int,
+    type_bool
+};
+
+
 class ExprAST {
+    SourceLocation Loc{};  // set by the parser; line 0 when there is none
+
     public:
     virtual ~ExprAST() = default;
+    SourceLocation getLoc() const {
+        return Loc;
+    }
+    void setLoc(SourceLocation L) {
+        Loc = L;
+    }
     virtual Value *codegen() = 0;
+    virtual uint32_t serialize(ASTWriter &W) const = 0;
+
+    // AST optimizer hooks, see ASTOpt.cpp.
+    virtual std::unique_ptr<ExprAST> optimize() {
+        return nullptr;
+    }
+    virtual void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) {}
+    virtual void getBoundNames(std::vector<std::string> &Names) const {}
+    virtual void getCallees(std::vector<std::string> &Names) const {}
+    virtual bool isSpeculatable() const {
+        return false;
+    }
+    virtual bool isLoop() const {
+        return false;
+    }
+    virtual bool isParallelLoop() const {
+        return false;
+    }
+    virtual bool isCompare() const {
+        return false;
+    }
+    virtual bool getConstant(double &V) const {
+        return false;
+    }
+    virtual bool isIntConstant() const {
+        return false;
+    }
+    virtual const std::string *getVariableName() const {
+        return nullptr;
+    }
 };
 
 
 class NumberExprAST : public ExprAST {
     double Val;
+    bool IsInt;  // written without '.' or exponent; a double unless it meets an integer
 
     public:
-    NumberExprAST(double Val) : Val(Val) {}
+    NumberExprAST(double Val, bool IsInt = false) : Val(Val), IsInt(IsInt) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    bool isSpeculatable() const override {
+        return true;
+    }
+    bool getConstant(double &V) const override {
+        V = Val;
+        return true;
+    }
+    bool isIntConstant() const override {
+        return IsInt;
+    }
 };
 
 
@@ -23,9 +83,16 @@ class VariableExprAST : public ExprAST {
     public:
     VariableExprAST(const std::string &Name) : Name(Name) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
     const std::string &getName() const {
         return Name;
     }
+    bool isSpeculatable() const override {
+        return true;
+    }
+    const std::string *getVariableName() const override {
+        return &Name;
+    }
 };
 
 
@@ -37,9 +104,23 @@ class UnaryAST : public ExprAST {
     UnaryAST(char Opcode, std::unique_ptr<ExprAST> Operand)
         : Opcode(Opcode), Opcode(std::move(Operand)) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        Children.push_back(&Operand);
+    }
+    void getCallees(std::vector<std::string> &Names) const override {
+        Names.push_back(std::string("unary") + Opcode);
+    }
 };
 
 
+/// IsBuiltinBinaryOp - whether codegen lowers Op to an instruction rather
+/// than a call to the user's "binary" definition ('=' aside).
+static bool IsBuiltinBinaryOp(char Op) {
+    return Op == '+' || Op == '-' || Op == '*' || Op == '<';
+}
+
+
 class BinaryExprAST : public ExprAST {
     char Op;
     std::unique_ptr<ExprAST> LHS, RHS;
@@ -48,10 +129,31 @@ class BinaryExprAST : public ExprAST {
     BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
         : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    std::unique_ptr<ExprAST> optimize() override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        Children.push_back(&LHS);
+        Children.push_back(&RHS);
+    }
+    void getBoundNames(std::vector<std::string> &Names) const override {
+        if(Op == '=' && LHS->getVariableName())
+            Names.push_back(*LHS->getVariableName());
+    }
+    void getCallees(std::vector<std::string> &Names) const override {
+        if(Op != '=' && !isSpeculatable())
+            Names.push_back(std::string("binary") + Op);
+    }
+    bool isSpeculatable() const override {
+        return IsBuiltinBinaryOp(Op);
+    }
+    bool isCompare() const override {
+        return Op == '<';
+    }
 };
 
 
 class CallExprAST : public ExprAST {
+    protected:
     std::string Callee;
     std::vector<std::unique_ptr<ExprAST>> Args;
 
@@ -59,6 +161,25 @@ class CallExprAST : public ExprAST {
     CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args)
         : Callee(Callee), Args(std::move(Args)) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        for(auto &Arg : Args)
+            Children.push_back(&Arg);
+    }
+    void getCallees(std::vector<std::string> &Names) const override {
+        Names.push_back(Callee);
+    }
+};
+
+
+/// AwaitExprAST - "await f(args)": call the async function f and suspend
+/// the caller until the future it returns is ready.
+class AwaitExprAST : public CallExprAST {
+    public:
+    AwaitExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args)
+        : CallExprAST(Callee, std::move(Args)) {}
+    Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
 };
 
 
@@ -69,21 +190,62 @@ class IfExprAST : public ExprAST {
     IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
         : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    std::unique_ptr<ExprAST> optimize() override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        Children.push_back(&Cond);
+        Children.push_back(&Then);
+        Children.push_back(&Else);
+    }
+    bool isSpeculatable() const override {
+        return true;
+    }
 };
 
 
 class ForExprAST : public ExprAST {
     std::string VarName;
     std::unique_ptr<ExprAST> Start, End, Step, Body;
+    char Reduction;
+    bool IsParallel;
 
     public:
     ForExprAST(const std::string &VarName,
                std::unique_ptr<ExprAST> Start,
                std::unique_ptr<ExprAST> End,
                std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+               std::unique_ptr<ExprAST> Body,
+               char Reduction = 0,
+               bool IsParallel = false)
+        : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)),
+          Reduction(Reduction), IsParallel(IsParallel) {}
+    /// getReduction - '+', '*', '<' (min) or '>' (max) for a loop that
+    /// combines its body's values, 0 for a plain for.
+    char getReduction() const {
+        return Reduction;
+    }
+    bool isParallel() const {
+        return IsParallel;
+    }
+    bool isParallelLoop() const override {
+        return IsParallel;
+    }
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    std::unique_ptr<ExprAST> optimize() override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        Children.push_back(&Start);
+        Children.push_back(&End);
+        if(Step)
+            Children.push_back(&Step);
+        Children.push_back(&Body);
+    }
+    void getBoundNames(std::vector<std::string> &Names) const override {
+        Names.push_back(VarName);
+    }
+    bool isLoop() const override {
+        return true;
+    }
 };
 
 
@@ -96,6 +258,28 @@ class VarExprAST : public ExprAST {
                std::unique_ptr<ExprAST> Body)
         : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
     Value *codegen() override;
+    uint32_t serialize(ASTWriter &W) const override;
+    void getChildren(std::vector<std::unique_ptr<ExprAST> *> &Children) override {
+        for(auto &Var : VarNames)
+            if(Var.second)
+                Children.push_back(&Var.second);
+        Children.push_back(&Body);
+    }
+    void getBoundNames(std::vector<std::string> &Names) const override {
+        for(auto &Var : VarNames)
+            Names.push_back(Var.first);
+    }
+};
+
+
+/// FunctionEffects - what a definition does, callees included. Pure: its
+/// result depends only on its arguments. ReadNone: it touches no memory but
+/// its own stack, which a memo cache does. WillReturn: it has no loops and
+/// no recursion.
+struct FunctionEffects {
+    bool Pure;
+    bool ReadNone;
+    bool WillReturn;
 };
 
 
@@ -104,18 +288,36 @@ class PrototypeAST {
     std::vector<std::string> Args;
     bool IsOperator;
     unsigned Precedence;
+    std::vector<ExprType> ArgTypes;
+    ExprType RetType;
+    bool IsAsync = false;
+    bool HasEffects = false;
+    FunctionEffects Effects;
+    SourceLocation Loc{};
 
     public:
     PrototypeAST(const std::string &Name,
                  std::vector<std::string> Args,
                  bool IsOperator = false,
-                 unsigned Prec = 0)
-        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec) {}
+                 unsigned Prec = 0,
+                 std::vector<ExprType> ArgTypes = {},
+                 ExprType RetType = type_double)
+        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec),
+          ArgTypes(std::move(ArgTypes)), RetType(RetType) {}
 
     Function *codegen();
     const std::string &getName() const {
         return Name;
     }
+    const std::vector<std::string> &getArgs() const {
+        return Args;
+    }
+    SourceLocation getLoc() const {
+        return Loc;
+    }
+    void setLoc(SourceLocation L) {
+        Loc = L;
+    }
 
     bool isUnaryOp() const {
         return IsOperator && Args.size() == 1;
@@ -132,17 +334,58 @@ class PrototypeAST {
     unsigned getBinaryPrecedence() const {
         return Precedence;
     }
+
+    ExprType getArgType(unsigned i) const {
+        return i < ArgTypes.size() ? ArgTypes[i] : type_double;
+    }
+    ExprType getReturnType() const {
+        return RetType;
+    }
+
+    /// isAsync - whether calls return a future of the result, to be awaited.
+    /// Async externs are declared so; a def is async when it awaits.
+    bool isAsync() const {
+        return IsAsync;
+    }
+    void setAsync(bool A) {
+        IsAsync = A;
+    }
+
+    /// getEffects - the effects analyzeEffects found for the definition, or
+    /// null for an extern. They travel with the prototype, so codegen on
+    /// another thread does not need the parser's table.
+    const FunctionEffects *getEffects() const {
+        return HasEffects ? &Effects : nullptr;
+    }
+    void setEffects(const FunctionEffects &E) {
+        Effects = E;
+        HasEffects = true;
+    }
+    void forgetEffects();
 };
 
 
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
     std::unique_ptr<ExprAST> Body;
+    bool IsMemo;
 
     public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body) 
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body, bool IsMemo = false)
+        : Proto(std::move(Proto)), Body(std::move(Body)), IsMemo(IsMemo) {}
     Function *codegen();
+    void optimize();
+    const FunctionEffects &analyzeEffects(std::string &Culprit);
+    void serialize(ASTWriter &W) const;
+    const std::string &getName() const {
+        return Proto->getName();
+    }
+    ExprAST *getBody() const {
+        return Body.get();
+    }
+    bool isMemo() const {
+        return IsMemo;
+    }
 };
 
 
@@ -0,0 +1,342 @@
+static cl::opt<bool> DisableASTOpt("disable-ast-opt",
+                                   cl::desc("Lower the AST to IR without simplifying it first"));
+static cl::opt<bool> ASTOptStats("ast-opt-stats",
+                                 cl::desc("Print AST optimizer statistics on exit"));
+
+
+static unsigned NumConstantsFolded = 0;
+static unsigned NumIdentitiesRemoved = 0;
+static unsigned NumBranchesPruned = 0;
+static unsigned NumInvariantsHoisted = 0;
+static unsigned NumNodesRemoved = 0;
+static unsigned NextHoistedId = 0;
+
+
+static unsigned ExprSize(ExprAST *E) {
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+
+    unsigned Size = 1;
+    for(auto *Child : Children)
+        Size += ExprSize(Child->get());
+    return Size;
+}
+
+
+/// OptimizeExpr - simplify the children of E bottom-up, then E itself,
+/// replacing E in place when its node returns a simpler equivalent.
+static void OptimizeExpr(std::unique_ptr<ExprAST> &E) {
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+    for(auto *Child : Children)
+        OptimizeExpr(*Child);
+
+    if(auto New = E->optimize())
+        E = std::move(New);
+}
+
+
+static void CollectBoundNames(ExprAST *E, std::set<std::string> &Names) {
+    std::vector<std::string> Bound;
+    E->getBoundNames(Bound);
+    Names.insert(Bound.begin(), Bound.end());
+
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+    for(auto *Child : Children)
+        CollectBoundNames(Child->get(), Names);
+}
+
+
+/// IsLoopInvariant - E has no side effects and reads no variable that the
+/// loop (re)binds or assigns.
+static bool IsLoopInvariant(ExprAST *E, const std::set<std::string> &Clobbered) {
+    if(!E->isSpeculatable())
+        return false;
+
+    if(auto *Name = E->getVariableName())
+        if(Clobbered.count(*Name))
+            return false;
+
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+    for(auto *Child : Children)
+        if(!IsLoopInvariant(Child->get(), Clobbered))
+            return false;
+    return true;
+}
+
+
+static void HoistInvariants(std::unique_ptr<ExprAST> &E,
+                            const std::set<std::string> &Clobbered,
+                            std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &Hoisted) {
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+
+    // Leaves are as cheap as the variable that would replace them.
+    if(!Children.empty() && IsLoopInvariant(E.get(), Clobbered)) {
+        std::string Name = "__licm" + std::to_string(NextHoistedId++);
+        SourceLocation Loc = E->getLoc();
+        Hoisted.push_back(std::make_pair(Name, std::move(E)));
+        E = std::make_unique<VariableExprAST>(Name);
+        E->setLoc(Loc);
+        ++NumInvariantsHoisted;
+        return;
+    }
+
+    for(auto *Child : Children)
+        HoistInvariants(*Child, Clobbered, Hoisted);
+}
+
+
+static std::unique_ptr<ExprAST> MakeConstant(double Val, bool IsInt, SourceLocation Loc) {
+    auto C = std::make_unique<NumberExprAST>(Val, IsInt);
+    C->setLoc(Loc);
+    return C;
+}
+
+
+std::unique_ptr<ExprAST> BinaryExprAST::optimize() {
+    if(!isSpeculatable())
+        return nullptr;
+
+    double L, R;
+    bool LConst = LHS->getConstant(L);
+    bool RConst = RHS->getConstant(R);
+
+    // A compare of doubles yields a bool, which no literal can stand for, so
+    // only compares of two integer literals fold.
+    bool IsInt = LConst && RConst && LHS->isIntConstant() && RHS->isIntConstant();
+    if(LConst && RConst && (IsInt || Op != '<')) {
+        double Result;
+        switch(Op) {
+            case '+':
+                Result = L + R;
+                break;
+            case '-':
+                Result = L - R;
+                break;
+            case '*':
+                Result = L * R;
+                break;
+            default:
+                // Matches the unordered compare emitted by codegen.
+                Result = std::isnan(L) || std::isnan(R) || L < R ? 1.0 : 0.0;
+                break;
+        }
+
+        // Past 2^53 the double payload rounds, so the result stays a double,
+        // just as codegen would compute it.
+        if(IsInt && std::fabs(Result) > 9007199254740992.0)
+            IsInt = false;
+
+        ++NumConstantsFolded;
+        return MakeConstant(Result, IsInt, getLoc());
+    }
+
+    // Only integer identities are dropped: x*1.0 must still widen an integer
+    // x to double. x*0 is not folded: it is NaN for NaN and infinite x.
+    // Dropping a +0 only differs from IEEE when x is -0.0, which no
+    // comparison observes.
+    RConst = RConst && RHS->isIntConstant();
+    LConst = LConst && LHS->isIntConstant();
+    if((Op == '*' && RConst && R == 1.0) || ((Op == '+' || Op == '-') && RConst && R == 0.0)) {
+        ++NumIdentitiesRemoved;
+        return std::move(LHS);
+    }
+    if((Op == '*' && LConst && L == 1.0) || (Op == '+' && LConst && L == 0.0)) {
+        ++NumIdentitiesRemoved;
+        return std::move(RHS);
+    }
+
+    return nullptr;
+}
+
+
+/// GetBranchType - the type E has as an 'if' arm, where no integer literal is
+/// adopted, or false when only codegen knows it.
+static bool GetBranchType(const ExprAST &E, ExprType &Ty) {
+    double V;
+    if(E.getConstant(V)) {
+        Ty = type_double;
+        return true;
+    }
+    if(E.isCompare()) {
+        Ty = type_bool;
+        return true;
+    }
+    return false;
+}
+
+
+std::unique_ptr<ExprAST> IfExprAST::optimize() {
+    double C;
+    if(!Cond->getConstant(C))
+        return nullptr;
+
+    // Codegen would join the arms' types, so an arm can only stand alone
+    // when both types are known; otherwise the branch is left to LLVM.
+    ExprType ThenTy, ElseTy;
+    if(!GetBranchType(*Then, ThenTy) || !GetBranchType(*Else, ElseTy))
+        return nullptr;
+
+    ++NumBranchesPruned;
+    // Codegen tests the condition with an ordered '!= 0.0', so NaN is false.
+    bool TakeThen = !std::isnan(C) && C != 0.0;
+    std::unique_ptr<ExprAST> &Arm = TakeThen ? Then : Else;
+
+    // A literal arm is a double, never an integer its user may adopt.
+    double V;
+    if(Arm->getConstant(V))
+        return MakeConstant(V, false, Arm->getLoc());
+    if(ThenTy == ElseTy)
+        return std::move(Arm);
+
+    // A bool arm joined with a double one widens; '+ 0.0' converts it the
+    // same way, and no bool is -0.0.
+    SourceLocation Loc = Arm->getLoc();
+    auto Widened = std::make_unique<BinaryExprAST>('+', std::move(Arm), MakeConstant(0.0, false, Loc));
+    Widened->setLoc(Loc);
+    return Widened;
+}
+
+
+std::unique_ptr<ExprAST> ForExprAST::optimize() {
+    // Hoisted values are computed before Start, so anything Start assigns
+    // counts as clobbered too.
+    std::set<std::string> Clobbered;
+    Clobbered.insert(VarName);
+    CollectBoundNames(Start.get(), Clobbered);
+    CollectBoundNames(End.get(), Clobbered);
+    if(Step)
+        CollectBoundNames(Step.get(), Clobbered);
+    CollectBoundNames(Body.get(), Clobbered);
+
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Hoisted;
+    HoistInvariants(End, Clobbered, Hoisted);
+    if(Step)
+        HoistInvariants(Step, Clobbered, Hoisted);
+    HoistInvariants(Body, Clobbered, Hoisted);
+
+    if(Hoisted.empty())
+        return nullptr;
+
+    auto Loop = std::make_unique<ForExprAST>(VarName, std::move(Start), std::move(End),
+                                             std::move(Step), std::move(Body), Reduction, IsParallel);
+    Loop->setLoc(getLoc());
+    auto Result = std::make_unique<VarExprAST>(std::move(Hoisted), std::move(Loop));
+    Result->setLoc(getLoc());
+    return Result;
+}
+
+
+void FunctionAST::optimize() {
+    if(DisableASTOpt)
+        return;
+
+    // Hoisting adds a binding per invariant, so report the net change.
+    unsigned OldSize = ExprSize(Body.get());
+    OptimizeExpr(Body);
+    unsigned NewSize = ExprSize(Body.get());
+    if(NewSize < OldSize)
+        NumNodesRemoved += OldSize - NewSize;
+}
+
+
+// Effects of the definitions seen so far, for the analysis of the ones that
+// call them. Only the parser uses it; codegen reads each prototype's copy.
+static std::map<std::string, FunctionEffects> KnownEffects;
+
+// Library functions known to have no side effects. They may set errno, so
+// they are not ReadNone.
+static const std::set<std::string> PureLibraryFunctions = {
+    "sin", "cos", "tan", "atan", "atan2", "exp", "log", "pow", "sqrt", "fabs", "floor", "ceil", "fmod"};
+
+
+static void CollectCallees(ExprAST *E, std::set<std::string> &Names) {
+    std::vector<std::string> Callees;
+    E->getCallees(Callees);
+    Names.insert(Callees.begin(), Callees.end());
+
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+    for(auto *Child : Children)
+        CollectCallees(Child->get(), Names);
+}
+
+
+/// Contains - whether Test holds for E or any expression in it.
+static bool Contains(ExprAST *E, bool (ExprAST::*Test)() const) {
+    if((E->*Test)())
+        return true;
+
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+    for(auto *Child : Children)
+        if(Contains(Child->get(), Test))
+            return true;
+    return false;
+}
+
+
+/// AnalyzeEffects - work out the effects of Proto's definition from what its
+/// body contains and the effects of the definitions before it, and remember
+/// them for the ones that follow. Assignments only ever reach the function's
+/// own locals, so everything hinges on the callees. Culprit is set to the
+/// first that is not pure.
+static const FunctionEffects &AnalyzeEffects(PrototypeAST &Proto, bool IsMemo, const std::set<std::string> &Callees,
+                                             bool HasLoop, bool HasParallelLoop, std::string &Culprit) {
+    // An async function hands its result over through the heap, and a
+    // parfor hands its body's frame to the runtime's threads.
+    bool IsAsync = Proto.isAsync();
+    FunctionEffects S = {!IsAsync, !IsMemo && !IsAsync && !HasParallelLoop, !HasLoop};
+    for(auto &Callee : Callees) {
+        if(Callee == Proto.getName()) {
+            S.WillReturn = false;
+            continue;
+        }
+
+        FunctionEffects CS = {false, false, false};
+        auto I = KnownEffects.find(Callee);
+        if(I != KnownEffects.end())
+            CS = I->second;
+        else if(PureLibraryFunctions.count(Callee))
+            CS = {true, false, true};
+
+        if(!CS.Pure && S.Pure)
+            Culprit = Callee;
+        S.Pure &= CS.Pure;
+        S.ReadNone &= CS.ReadNone;
+        S.WillReturn &= CS.WillReturn;
+    }
+
+    Proto.setEffects(S);
+    return KnownEffects[Proto.getName()] = S;
+}
+
+
+const FunctionEffects &FunctionAST::analyzeEffects(std::string &Culprit) {
+    std::set<std::string> Callees;
+    CollectCallees(Body.get(), Callees);
+    return AnalyzeEffects(*Proto, IsMemo, Callees, Contains(Body.get(), &ExprAST::isLoop),
+                          Contains(Body.get(), &ExprAST::isParallelLoop), Culprit);
+}
+
+
+/// forgetEffects - an extern replaces any definition of the same name, so
+/// callers analyzed from now on no longer count on what that did.
+void PrototypeAST::forgetEffects() {
+    KnownEffects.erase(Name);
+}
+
+
+static void PrintASTOptStatistics() {
+    if(!ASTOptStats)
+        return;
+
+    fprintf(stderr, "AST optimizer: %u nodes removed\n", NumNodesRemoved);
+    fprintf(stderr, "  %u constants folded\n", NumConstantsFolded);
+    fprintf(stderr, "  %u identities removed\n", NumIdentitiesRemoved);
+    fprintf(stderr, "  %u branches pruned\n", NumBranchesPruned);
+    fprintf(stderr, "  %u loop invariants hoisted\n", NumInvariantsHoisted);
+}
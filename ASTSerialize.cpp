@@ -0,0 +1,600 @@
+static cl::opt<std::string> EmitASTFile("emit-ast", cl::desc("Parse the input and write its binary AST to <filename>"),
+                                        cl::value_desc("filename"));
+static cl::opt<std::string> LoadASTFile("load-ast", cl::desc("Compile a binary AST written by -emit-ast instead of stdin"),
+                                        cl::value_desc("filename"));
+
+
+// Binary AST files hold every node of every function in one flat array,
+// children before parents, in host byte order:
+//
+//   ASTFileHeader
+//   double       Constants[NumConstants]
+//   ASTNode      Nodes[NumNodes]
+//   ASTFunction  Functions[NumFunctions]
+//   ASTArg       Args[NumArgs]
+//   uint32_t     Children[NumChildren]
+//   uint32_t     StringOffsets[NumStrings + 1]
+//   char         StringData[StringBytes]
+//
+// Every section before Children is a multiple of 8 bytes long, so each one
+// is aligned for its elements and a mapped file is used in place.
+enum ASTNodeKind : uint8_t {
+    node_number,
+    node_variable,
+    node_unary,
+    node_binary,
+    node_call,
+    node_if,
+    node_for,
+    node_var,
+    node_binding,   // one name of a var expression, with its initializer if any
+    node_await
+};
+
+
+static const uint32_t NoNode = ~0u;
+static const uint32_t ASTFileVersion = 1;
+
+
+struct ASTFileHeader {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t NumConstants;
+    uint32_t NumNodes;
+    uint32_t NumFunctions;
+    uint32_t NumArgs;
+    uint32_t NumChildren;
+    uint32_t NumStrings;
+    uint32_t StringBytes;
+    uint32_t Reserved;
+};
+
+
+struct ASTNode {
+    ASTNodeKind Kind;
+    uint8_t Op;             // operator character; 1 for integer literals
+    uint16_t Reserved;
+    uint32_t Name;          // constant id for numbers, otherwise a string id
+    uint32_t FirstChild;    // index into Children
+    uint32_t NumChildren;
+};
+
+
+struct ASTFunction {
+    uint32_t Name;
+    uint32_t FirstArg;
+    uint32_t NumArgs;
+    uint32_t Body;          // NoNode for an extern
+    uint32_t Precedence;
+    uint8_t IsOperator;
+    uint8_t RetType;
+    uint8_t IsMemo;
+    uint8_t IsAsync;
+};
+
+
+struct ASTArg {
+    uint32_t Name;
+    uint32_t Type;
+};
+
+
+static_assert(sizeof(ASTFileHeader) == 40 && sizeof(ASTNode) == 16 && sizeof(ASTFunction) == 24 &&
+              sizeof(ASTArg) == 8, "binary AST layout changed");
+
+
+class ASTWriter {
+    std::vector<double> Constants;
+    DenseMap<uint64_t, uint32_t> ConstantIds;
+    std::vector<ASTNode> Nodes;
+    std::vector<ASTFunction> Functions;
+    std::vector<ASTArg> Args;
+    std::vector<uint32_t> Children;
+    StringMap<uint32_t> StringIds;
+    std::vector<uint32_t> StringOffsets = {0};
+    std::string StringData;
+
+    public:
+    uint32_t addString(StringRef S) {
+        auto I = StringIds.insert({S, StringOffsets.size() - 1});
+        if(I.second) {
+            StringData += S;
+            StringOffsets.push_back(StringData.size());
+        }
+        return I.first->second;
+    }
+
+    uint32_t addConstant(double Val) {
+        auto I = ConstantIds.insert({DoubleToBits(Val), Constants.size()});
+        if(I.second)
+            Constants.push_back(Val);
+        return I.first->second;
+    }
+
+    uint32_t addNode(ASTNodeKind Kind, uint8_t Op, uint32_t Name, ArrayRef<uint32_t> Kids) {
+        ASTNode N = {};
+        N.Kind = Kind;
+        N.Op = Op;
+        N.Name = Name;
+        N.FirstChild = Children.size();
+        N.NumChildren = Kids.size();
+        Children.insert(Children.end(), Kids.begin(), Kids.end());
+        Nodes.push_back(N);
+        return Nodes.size() - 1;
+    }
+
+    void addFunction(const PrototypeAST &P, uint32_t Body, bool IsMemo = false) {
+        ASTFunction F = {};
+        F.Name = addString(P.getName());
+        F.FirstArg = Args.size();
+        F.NumArgs = P.getArgs().size();
+        F.Body = Body;
+        F.Precedence = P.isBinaryOp() ? P.getBinaryPrecedence() : 0;
+        F.IsOperator = P.isUnaryOp() || P.isBinaryOp();
+        F.RetType = P.getReturnType();
+        F.IsMemo = IsMemo;
+        F.IsAsync = P.isAsync();
+        for(unsigned i = 0; i != F.NumArgs; ++i)
+            Args.push_back({addString(P.getArgs()[i]), (uint32_t)P.getArgType(i)});
+        Functions.push_back(F);
+    }
+
+    void write(raw_ostream &OS) const;
+    bool write(StringRef Filename) const;
+};
+
+
+void ASTWriter::write(raw_ostream &OS) const {
+    ASTFileHeader H = {{'K', 'A', 'S', 'T'}, ASTFileVersion};
+    H.NumConstants = Constants.size();
+    H.NumNodes = Nodes.size();
+    H.NumFunctions = Functions.size();
+    H.NumArgs = Args.size();
+    H.NumChildren = Children.size();
+    H.NumStrings = StringOffsets.size() - 1;
+    H.StringBytes = StringData.size();
+
+    OS.write((const char *)&H, sizeof(H));
+    OS.write((const char *)Constants.data(), Constants.size() * sizeof(double));
+    OS.write((const char *)Nodes.data(), Nodes.size() * sizeof(ASTNode));
+    OS.write((const char *)Functions.data(), Functions.size() * sizeof(ASTFunction));
+    OS.write((const char *)Args.data(), Args.size() * sizeof(ASTArg));
+    OS.write((const char *)Children.data(), Children.size() * sizeof(uint32_t));
+    OS.write((const char *)StringOffsets.data(), StringOffsets.size() * sizeof(uint32_t));
+    OS << StringData;
+}
+
+
+bool ASTWriter::write(StringRef Filename) const {
+    std::error_code EC;
+    raw_fd_ostream OS(Filename, EC, sys::fs::OF_None);
+    if(EC) {
+        errs() << "Could not open file: " << EC.message();
+        return false;
+    }
+
+    write(OS);
+    return true;
+}
+
+
+uint32_t NumberExprAST::serialize(ASTWriter &W) const {
+    return W.addNode(node_number, IsInt, W.addConstant(Val), {});
+}
+
+
+uint32_t VariableExprAST::serialize(ASTWriter &W) const {
+    return W.addNode(node_variable, 0, W.addString(Name), {});
+}
+
+
+uint32_t UnaryExprAST::serialize(ASTWriter &W) const {
+    uint32_t Kid = Operand->serialize(W);
+    return W.addNode(node_unary, Opcode, NoNode, Kid);
+}
+
+
+uint32_t BinaryExprAST::serialize(ASTWriter &W) const {
+    uint32_t Kids[] = {LHS->serialize(W), RHS->serialize(W)};
+    return W.addNode(node_binary, Op, NoNode, Kids);
+}
+
+
+uint32_t CallExprAST::serialize(ASTWriter &W) const {
+    std::vector<uint32_t> Kids;
+    for(auto &Arg : Args)
+        Kids.push_back(Arg->serialize(W));
+    return W.addNode(node_call, 0, W.addString(Callee), Kids);
+}
+
+
+uint32_t AwaitExprAST::serialize(ASTWriter &W) const {
+    std::vector<uint32_t> Kids;
+    for(auto &Arg : Args)
+        Kids.push_back(Arg->serialize(W));
+    return W.addNode(node_await, 0, W.addString(Callee), Kids);
+}
+
+
+uint32_t IfExprAST::serialize(ASTWriter &W) const {
+    uint32_t Kids[] = {Cond->serialize(W), Then->serialize(W), Else->serialize(W)};
+    return W.addNode(node_if, 0, NoNode, Kids);
+}
+
+
+uint32_t ForExprAST::serialize(ASTWriter &W) const {
+    uint32_t Kids[] = {Start->serialize(W), End->serialize(W), Step ? Step->serialize(W) : NoNode,
+                       Body->serialize(W)};
+    // A reduction stores its operator, with the top bit set for parfor.
+    return W.addNode(node_for, Reduction | (IsParallel ? 0x80 : 0), W.addString(VarName), Kids);
+}
+
+
+uint32_t VarExprAST::serialize(ASTWriter &W) const {
+    std::vector<uint32_t> Kids;
+    for(auto &Var : VarNames) {
+        uint32_t Init = Var.second ? Var.second->serialize(W) : NoNode;
+        Kids.push_back(W.addNode(node_binding, 0, W.addString(Var.first), Init == NoNode ? ArrayRef<uint32_t>() : Init));
+    }
+    Kids.push_back(Body->serialize(W));
+    return W.addNode(node_var, 0, NoNode, Kids);
+}
+
+
+void FunctionAST::serialize(ASTWriter &W) const {
+    W.addFunction(*Proto, Body->serialize(W), IsMemo);
+}
+
+
+/// ASTFile - a binary AST mapped from disk. open() checks every index once,
+/// after which nodes, strings and functions are read straight out of the
+/// buffer.
+class ASTFile {
+    std::unique_ptr<MemoryBuffer> Buffer;
+    const ASTFileHeader *Header = nullptr;
+    const double *Constants = nullptr;
+    const ASTNode *Nodes = nullptr;
+    const ASTFunction *Functions = nullptr;
+    const ASTArg *Args = nullptr;
+    const uint32_t *Children = nullptr;
+    const uint32_t *StringOffsets = nullptr;
+    const char *StringData = nullptr;
+
+    bool validate() const;
+
+    public:
+    static std::unique_ptr<ASTFile> create(std::unique_ptr<MemoryBuffer> Buffer);
+    static std::unique_ptr<ASTFile> open(StringRef Filename);
+
+    uint32_t getNumNodes() const {
+        return Header->NumNodes;
+    }
+    uint32_t getNumFunctions() const {
+        return Header->NumFunctions;
+    }
+    const ASTNode &getNode(uint32_t Id) const {
+        return Nodes[Id];
+    }
+    double getConstant(uint32_t Id) const {
+        return Constants[Id];
+    }
+    const ASTFunction &getFunction(uint32_t i) const {
+        return Functions[i];
+    }
+    const ASTArg &getArg(uint32_t i) const {
+        return Args[i];
+    }
+    uint32_t getChild(const ASTNode &N, unsigned i) const {
+        return Children[N.FirstChild + i];
+    }
+    StringRef getString(uint32_t Id) const {
+        return StringRef(StringData + StringOffsets[Id], StringOffsets[Id + 1] - StringOffsets[Id]);
+    }
+
+    std::unique_ptr<ExprAST> getExpr(uint32_t Id) const;
+    std::unique_ptr<PrototypeAST> getPrototype(uint32_t i) const;
+};
+
+
+std::unique_ptr<ASTFile> ASTFile::open(StringRef Filename) {
+    auto Buffer = MemoryBuffer::getFile(Filename, -1, false);
+    if(!Buffer) {
+        errs() << "Could not open " << Filename << ": " << Buffer.getError().message() << "\n";
+        return nullptr;
+    }
+    return create(std::move(*Buffer));
+}
+
+
+/// create - take over Buffer, which must stay 8-byte aligned, as an AST file.
+std::unique_ptr<ASTFile> ASTFile::create(std::unique_ptr<MemoryBuffer> Buffer) {
+    StringRef Filename = Buffer->getBufferIdentifier();
+    auto File = std::make_unique<ASTFile>();
+    File->Buffer = std::move(Buffer);
+    const char *Data = File->Buffer->getBufferStart();
+    size_t Size = File->Buffer->getBufferSize();
+
+    File->Header = (const ASTFileHeader *)Data;
+    if(Size < sizeof(ASTFileHeader) || memcmp(File->Header->Magic, "KAST", 4) ||
+       File->Header->Version != ASTFileVersion) {
+        errs() << Filename << " is not a binary AST file\n";
+        return nullptr;
+    }
+
+    const ASTFileHeader &H = *File->Header;
+    uint64_t Offset = sizeof(ASTFileHeader);
+    uint64_t ConstantsAt = Offset;
+    Offset += (uint64_t)H.NumConstants * sizeof(double);
+    uint64_t NodesAt = Offset;
+    Offset += (uint64_t)H.NumNodes * sizeof(ASTNode);
+    uint64_t FunctionsAt = Offset;
+    Offset += (uint64_t)H.NumFunctions * sizeof(ASTFunction);
+    uint64_t ArgsAt = Offset;
+    Offset += (uint64_t)H.NumArgs * sizeof(ASTArg);
+    uint64_t ChildrenAt = Offset;
+    Offset += (uint64_t)H.NumChildren * sizeof(uint32_t);
+    uint64_t StringOffsetsAt = Offset;
+    Offset += ((uint64_t)H.NumStrings + 1) * sizeof(uint32_t);
+    uint64_t StringDataAt = Offset;
+    Offset += H.StringBytes;
+
+    if(Offset != Size) {
+        errs() << Filename << ": truncated or corrupt binary AST\n";
+        return nullptr;
+    }
+
+    File->Constants = (const double *)(Data + ConstantsAt);
+    File->Nodes = (const ASTNode *)(Data + NodesAt);
+    File->Functions = (const ASTFunction *)(Data + FunctionsAt);
+    File->Args = (const ASTArg *)(Data + ArgsAt);
+    File->Children = (const uint32_t *)(Data + ChildrenAt);
+    File->StringOffsets = (const uint32_t *)(Data + StringOffsetsAt);
+    File->StringData = Data + StringDataAt;
+
+    if(!File->validate()) {
+        errs() << Filename << ": corrupt binary AST\n";
+        return nullptr;
+    }
+    return File;
+}
+
+
+/// validate - every index must be in range, children must come before their
+/// parents, which rules out cycles, and every node must belong to exactly
+/// one parent or function. A node shared by several parents would have
+/// getExpr copy it once per path, exponentially many times in a crafted file.
+bool ASTFile::validate() const {
+    const ASTFileHeader &H = *Header;
+    for(uint32_t i = 0; i != H.NumStrings; ++i)
+        if(StringOffsets[i] > StringOffsets[i + 1])
+            return false;
+    if(StringOffsets[0] != 0 || StringOffsets[H.NumStrings] != H.StringBytes)
+        return false;
+
+    // The parser only builds binary nodes for operators it knows about; here
+    // they must be builtin or defined in this file or the prelude.
+    bool BinaryOps[256] = {};
+    for(char Op : {'+', '-', '*', '<', '='})
+        BinaryOps[(uint8_t)Op] = true;
+    for(auto &Entry : FunctionProtos)
+        if(Entry.second->isBinaryOp())
+            BinaryOps[(uint8_t)Entry.second->getOperatorName()] = true;
+    for(uint32_t i = 0; i != H.NumFunctions; ++i) {
+        const ASTFunction &F = Functions[i];
+        if(F.Name < H.NumStrings && F.IsOperator && F.NumArgs == 2 && getString(F.Name).startswith("binary"))
+            BinaryOps[(uint8_t)getString(F.Name).back()] = true;
+    }
+
+    // A for node's low bits are 0 for a plain loop or a reduction's operator,
+    // as GetReductionOp gives it.
+    bool Reductions[128] = {};
+    for(char Op : {'\0', '+', '*', '<', '>'})
+        Reductions[(uint8_t)Op] = true;
+
+    std::vector<uint8_t> Parents(H.NumNodes);
+    // Whether each node's subtree awaits; only async functions may.
+    std::vector<bool> Awaits(H.NumNodes);
+    auto Adopt = [&](uint32_t Id) { return Id == NoNode || ++Parents[Id] == 1; };
+
+    static const uint32_t Arity[] = {0, 0, 1, 2, ~0u, 3, 4, ~0u, ~0u, ~0u};
+    for(uint32_t i = 0; i != H.NumNodes; ++i) {
+        const ASTNode &N = Nodes[i];
+        if(N.Kind > node_await || (uint64_t)N.FirstChild + N.NumChildren > H.NumChildren)
+            return false;
+        if(Arity[N.Kind] != ~0u && N.NumChildren != Arity[N.Kind])
+            return false;
+        if(N.Kind == node_var && N.NumChildren == 0)
+            return false;
+        if(N.Kind == node_binding && N.NumChildren > 1)
+            return false;
+
+        switch(N.Kind) {
+            case node_number:
+                if(N.Name >= H.NumConstants)
+                    return false;
+                break;
+            case node_variable:
+            case node_call:
+            case node_for:
+            case node_binding:
+            case node_await:
+                if(N.Name >= H.NumStrings)
+                    return false;
+                break;
+            default:
+                if(N.Name != NoNode)
+                    return false;
+                break;
+        }
+
+        for(uint32_t c = 0; c != N.NumChildren; ++c) {
+            uint32_t Kid = getChild(N, c);
+            bool Optional = N.Kind == node_for && c == 2;
+            if(Kid == NoNode ? !Optional : Kid >= i)
+                return false;
+            if(!Adopt(Kid))
+                return false;
+            if(Kid != NoNode && Awaits[Kid])
+                Awaits[i] = true;
+            if(Kid != NoNode && (N.Kind == node_var && c + 1 != N.NumChildren) != (Nodes[Kid].Kind == node_binding))
+                return false;
+        }
+
+        if(N.Kind == node_await)
+            Awaits[i] = true;
+        if(N.Kind == node_binary && !BinaryOps[N.Op])
+            return false;
+        if(N.Kind == node_for && !Reductions[N.Op & 0x7f])
+            return false;
+        if(N.Kind == node_binary && N.Op == '=' && Nodes[getChild(N, 0)].Kind != node_variable)
+            return false;
+    }
+
+    for(uint32_t i = 0; i != H.NumFunctions; ++i) {
+        const ASTFunction &F = Functions[i];
+        if(F.Name >= H.NumStrings || (uint64_t)F.FirstArg + F.NumArgs > H.NumArgs || F.RetType > type_bool)
+            return false;
+        // A memo cache would hand out a future that the first await freed.
+        if(F.IsMemo && F.IsAsync)
+            return false;
+        if(F.Body != NoNode && (F.Body >= H.NumNodes || Nodes[F.Body].Kind == node_binding))
+            return false;
+        if(!Adopt(F.Body))
+            return false;
+        if(F.Body != NoNode && Awaits[F.Body] && !F.IsAsync)
+            return false;
+    }
+    if(std::count(Parents.begin(), Parents.end(), 0))
+        return false;
+    for(uint32_t i = 0; i != H.NumArgs; ++i)
+        if(Args[i].Name >= H.NumStrings || Args[i].Type > type_bool)
+            return false;
+    return true;
+}
+
+
+std::unique_ptr<ExprAST> ASTFile::getExpr(uint32_t Id) const {
+    const ASTNode &N = Nodes[Id];
+    auto Kid = [&](unsigned i) { return getExpr(getChild(N, i)); };
+
+    switch(N.Kind) {
+        case node_number:
+            return std::make_unique<NumberExprAST>(Constants[N.Name], N.Op != 0);
+        case node_variable:
+            return std::make_unique<VariableExprAST>(getString(N.Name).str());
+        case node_unary:
+            return std::make_unique<UnaryExprAST>(N.Op, Kid(0));
+        case node_binary:
+            return std::make_unique<BinaryExprAST>(N.Op, Kid(0), Kid(1));
+        case node_call: {
+            std::vector<std::unique_ptr<ExprAST>> Args;
+            for(unsigned i = 0; i != N.NumChildren; ++i)
+                Args.push_back(Kid(i));
+            return std::make_unique<CallExprAST>(getString(N.Name).str(), std::move(Args));
+        }
+        case node_await: {
+            std::vector<std::unique_ptr<ExprAST>> Args;
+            for(unsigned i = 0; i != N.NumChildren; ++i)
+                Args.push_back(Kid(i));
+            return std::make_unique<AwaitExprAST>(getString(N.Name).str(), std::move(Args));
+        }
+        case node_if:
+            return std::make_unique<IfExprAST>(Kid(0), Kid(1), Kid(2));
+        case node_for: {
+            auto Start = Kid(0);
+            auto End = Kid(1);
+            auto Step = getChild(N, 2) == NoNode ? nullptr : Kid(2);
+            return std::make_unique<ForExprAST>(getString(N.Name).str(), std::move(Start), std::move(End),
+                                                std::move(Step), Kid(3), N.Op & 0x7f, (N.Op & 0x80) != 0);
+        }
+        case node_var: {
+            std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+            for(unsigned i = 0; i + 1 != N.NumChildren; ++i) {
+                const ASTNode &B = Nodes[getChild(N, i)];
+                VarNames.emplace_back(getString(B.Name).str(), B.NumChildren ? getExpr(getChild(B, 0)) : nullptr);
+            }
+            return std::make_unique<VarExprAST>(std::move(VarNames), Kid(N.NumChildren - 1));
+        }
+        case node_binding:
+            break;
+    }
+    return nullptr;
+}
+
+
+std::unique_ptr<PrototypeAST> ASTFile::getPrototype(uint32_t i) const {
+    const ASTFunction &F = Functions[i];
+    std::vector<std::string> ArgNames;
+    std::vector<ExprType> ArgTypes;
+    for(uint32_t a = F.FirstArg, e = F.FirstArg + F.NumArgs; a != e; ++a) {
+        ArgNames.push_back(getString(Args[a].Name).str());
+        ArgTypes.push_back((ExprType)Args[a].Type);
+    }
+    auto Proto = std::make_unique<PrototypeAST>(getString(F.Name).str(), std::move(ArgNames), F.IsOperator != 0,
+                                                F.Precedence, std::move(ArgTypes), (ExprType)F.RetType);
+    Proto->setAsync(F.IsAsync != 0);
+    return Proto;
+}
+
+
+/// WriteASTFile - parse stdin to the end and write every def, extern and
+/// top-level expression to Filename.
+static bool WriteASTFile(StringRef Filename) {
+    ASTWriter W;
+    getNextToken();
+    while(CurTok != tok_eof && !ErrorLimitReached()) {
+        switch(CurTok) {
+            case ';':
+                getNextToken();
+                continue;
+            case tok_def:
+                if(auto FnAST = ParseDefinition())
+                    FnAST->serialize(W);
+                else
+                    SynchronizeParser();
+                break;
+            case tok_extern:
+                if(auto ProtoAST = ParseExtern())
+                    W.addFunction(*ProtoAST, NoNode);
+                else
+                    SynchronizeParser();
+                break;
+            default:
+                if(auto FnAST = ParseTopLevelExpr())
+                    FnAST->serialize(W);
+                else
+                    SynchronizeParser();
+                break;
+        }
+    }
+    return !NumErrors && W.write(Filename);
+}
+
+
+/// CodegenASTFile - generate code for Filename into the current module, as
+/// the REPL would have for the source it came from.
+static bool CodegenASTFile(StringRef Filename) {
+    auto File = ASTFile::open(Filename);
+    if(!File)
+        return false;
+
+    for(uint32_t i = 0, e = File->getNumFunctions(); i != e; ++i) {
+        auto Proto = File->getPrototype(i);
+        uint32_t Body = File->getFunction(i).Body;
+        if(Body == NoNode) {
+            Proto->forgetEffects();
+            FunctionProtos[Proto->getName()] = std::move(Proto);
+            continue;
+        }
+
+        bool IsAsync = Proto->isAsync();
+        FunctionAST Fn(std::move(Proto), File->getExpr(Body), File->getFunction(i).IsMemo);
+        std::string Culprit;
+        auto &Effects = Fn.analyzeEffects(Culprit);
+        if(Fn.isMemo() && !CheckMemoEffects(SourceLocation(), Effects, IsAsync, Culprit))
+            continue;
+        Fn.optimize();
+        Fn.codegen();
+    }
+    return true;
+}
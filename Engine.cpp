@@ -0,0 +1,275 @@
+static std::unique_ptr<TargetMachine> EngineTM;
+static unsigned NextDylibId = 0;
+
+// The parser and IR generator work on globals, so one compile at a time.
+static std::mutex CompileMutex;
+
+
+bool InitializeEngine() {
+    if(!TheJIT && !InitializeJIT())
+        return false;
+
+    auto TM = JITTMB->createTargetMachine();
+    if(!TM)
+        return !LogJITError(TM.takeError());
+    EngineTM = std::move(*TM);
+    return true;
+}
+
+
+/// EmitBatchWrapper - emit "<F>.batch", a loop over rows that loads one
+/// double per argument column, calls F and stores the result. Once F is
+/// inlined the loop is an ordinary vectorizable kernel.
+static Function *EmitBatchWrapper(Function *F) {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *DoublePtrTy = DoubleTy->getPointerTo();
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+
+    Type *Params[] = {DoublePtrTy->getPointerTo(), DoublePtrTy, Int64Ty};
+    FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext), Params, false);
+    Function *Batch = Function::Create(FT, Function::ExternalLinkage, F->getName() + ".batch", TheModule.get());
+
+    Argument *Columns = Batch->getArg(0);
+    Argument *Out = Batch->getArg(1);
+    Argument *NumRows = Batch->getArg(2);
+    Columns->setName("columns");
+    Out->setName("out");
+    NumRows->setName("rows");
+    Out->addAttr(Attribute::NoAlias);
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", Batch);
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", Batch);
+    BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "exit", Batch);
+
+    Builder->SetInsertPoint(EntryBB);
+    std::vector<Value *> ColumnPtrs;
+    for(unsigned i = 0, e = F->arg_size(); i != e; ++i) {
+        Value *Slot = Builder->CreateConstInBoundsGEP1_64(DoublePtrTy, Columns, i);
+        ColumnPtrs.push_back(Builder->CreateLoad(DoublePtrTy, Slot, "column"));
+    }
+    Value *Empty = Builder->CreateICmpEQ(NumRows, ConstantInt::get(Int64Ty, 0), "empty");
+    Builder->CreateCondBr(Empty, ExitBB, LoopBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Row = Builder->CreatePHI(Int64Ty, 2, "row");
+    Row->addIncoming(ConstantInt::get(Int64Ty, 0), EntryBB);
+
+    std::vector<Value *> Args;
+    for(auto *Column : ColumnPtrs)
+        Args.push_back(Builder->CreateLoad(DoubleTy, Builder->CreateInBoundsGEP(DoubleTy, Column, Row), "arg"));
+
+    Value *Result = ConvertTo(EmitCall(F, Args, "result"), DoubleTy);
+    Builder->CreateStore(Result, Builder->CreateInBoundsGEP(DoubleTy, Out, Row));
+
+    Value *Next = Builder->CreateAdd(Row, ConstantInt::get(Int64Ty, 1), "next", true, true);
+    Row->addIncoming(Next, LoopBB);
+    Builder->CreateCondBr(Builder->CreateICmpULT(Next, NumRows), LoopBB, ExitBB);
+
+    Builder->SetInsertPoint(ExitBB);
+    Builder->CreateRetVoid();
+
+    verifyFunction(*Batch);
+    return Batch;
+}
+
+
+/// ParseSource - parse and codegen every def and extern in Source into the
+/// current module. Returns the name of the last def, or "" on error.
+static std::string ParseSource(const std::string &Source) {
+    SetLexerInput(Source.data(), Source.data() + Source.size());
+    getNextToken();
+
+    std::string LastDef;
+    bool OK = true;
+    while(OK && CurTok != tok_eof) {
+        switch(CurTok) {
+            case ';':
+                getNextToken();
+                break;
+            case tok_def:
+                if(auto FnAST = ParseDefinition()) {
+                    FnAST->optimize();
+                    LastDef = FnAST->getName();
+                    OK = FnAST->codegen() != nullptr;
+                } else {
+                    OK = false;
+                }
+                break;
+            case tok_extern:
+                if(auto ProtoAST = ParseExtern())
+                    FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+                else
+                    OK = false;
+                break;
+            default:
+                LogError("expected 'def' or 'extern'");
+                OK = false;
+                break;
+        }
+    }
+
+    SetLexerInput(nullptr, nullptr);
+    return OK ? LastDef : "";
+}
+
+
+/// CompileFunction - compile Source, which holds defs and externs, into a
+/// JITDylib of its own and return the def called Name (the last one when
+/// Name is empty) together with its batch entry point. Each call is
+/// self-contained: the prototypes, effects and operators of earlier
+/// formulas are forgotten, so separate formulas may reuse names. Async defs
+/// are refused: they return a future, not the double callers expect.
+std::unique_ptr<CompiledFunction> CompileFunction(const std::string &Source, const std::string &Name) {
+    std::lock_guard<std::mutex> Lock(CompileMutex);
+
+    if(!EngineTM && !InitializeEngine())
+        return nullptr;
+
+    InitializeModuleAndPassManager();
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+    TheModule->setTargetTriple(EngineTM->getTargetTriple().str());
+    FunctionProtos.clear();
+    KnownEffects.clear();
+    InstallBuiltinOperators();
+    // -ferror-limit is per formula, not per host process.
+    NumErrors = 0;
+
+    std::string LastDef = ParseSource(Source);
+    if(LastDef.empty())
+        return nullptr;
+
+    std::string Target = Name.empty() ? LastDef : Name;
+    Function *F = TheModule->getFunction(Target);
+    if(!F || F->isDeclaration()) {
+        LogError("function to compile is not defined");
+        return nullptr;
+    }
+    if(IsAsyncFunction(Target)) {
+        LogError("function to compile is async");
+        return nullptr;
+    }
+
+    auto Result = std::make_unique<CompiledFunction>();
+    Result->Name = Target;
+    Result->NumArgs = F->arg_size();
+
+    EmitBatchWrapper(F);
+    FinalizeDebugInfo();
+    RunPassPipeline(*TheModule, EngineTM.get(), OptimizationLevel::O3);
+
+    auto JD = TheJIT->createJITDylib("formula" + std::to_string(NextDylibId++));
+    if(!JD) {
+        LogJITError(JD.takeError());
+        return nullptr;
+    }
+    JD->addGenerator(cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        TheJIT->getDataLayout().getGlobalPrefix())));
+
+    if(LogJITError(TheJIT->addIRModule(*JD, orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)))))
+        return nullptr;
+
+    auto Sym = TheJIT->lookup(*JD, Target);
+    if(!Sym) {
+        LogJITError(Sym.takeError());
+        return nullptr;
+    }
+    auto BatchSym = TheJIT->lookup(*JD, Target + ".batch");
+    if(!BatchSym) {
+        LogJITError(BatchSym.takeError());
+        return nullptr;
+    }
+
+    Result->Address = Sym->getAddress();
+    Result->Batch = reinterpret_cast<BatchFunction>(BatchSym->getAddress());
+    return Result;
+}
+
+
+/// HazardSlot - the snapshot one thread is reading, if any, on a cache line
+/// of its own. Slots are never freed; a thread's slot is reused by a later
+/// thread once it exits.
+struct alignas(64) HazardSlot {
+    std::atomic<const void *> Protected{nullptr};
+    std::atomic<bool> InUse{true};
+    HazardSlot *Next = nullptr;
+};
+static std::atomic<HazardSlot *> HazardSlots{nullptr};
+
+
+static HazardSlot *AcquireHazardSlot() {
+    for(HazardSlot *S = HazardSlots.load(std::memory_order_acquire); S; S = S->Next) {
+        bool Free = false;
+        if(S->InUse.compare_exchange_strong(Free, true, std::memory_order_acquire))
+            return S;
+    }
+
+    auto *S = new HazardSlot;
+    S->Next = HazardSlots.load(std::memory_order_relaxed);
+    while(!HazardSlots.compare_exchange_weak(S->Next, S, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return S;
+}
+
+
+struct HazardSlotOwner {
+    HazardSlot *Slot = AcquireHazardSlot();
+    ~HazardSlotOwner() {
+        Slot->Protected.store(nullptr, std::memory_order_release);
+        Slot->InUse.store(false, std::memory_order_release);
+    }
+};
+static thread_local HazardSlotOwner ThreadHazard;
+
+
+FunctionRegistry::FunctionRegistry() : Live(std::make_unique<Snapshot>()) {
+    Current.store(Live.get(), std::memory_order_release);
+}
+
+
+/// lookup - publish the snapshot in this thread's slot, then check that it
+/// is still current. Both are seq_cst, as is compile()'s publication before
+/// it scans the slots, so either compile() sees the mark or the check sees
+/// the new snapshot and the lookup retries with it.
+const CompiledFunction *FunctionRegistry::lookup(const std::string &Name) const {
+    HazardSlot *Slot = ThreadHazard.Slot;
+    const Snapshot *S = Current.load(std::memory_order_acquire);
+    while(true) {
+        Slot->Protected.store(S);
+        const Snapshot *Now = Current.load();
+        if(Now == S)
+            break;
+        S = Now;
+    }
+
+    auto I = S->find(Name);
+    const CompiledFunction *F = I != S->end() ? I->second : nullptr;
+    Slot->Protected.store(nullptr, std::memory_order_release);
+    return F;
+}
+
+
+const CompiledFunction *FunctionRegistry::compile(const std::string &Source, const std::string &Name) {
+    auto F = CompileFunction(Source, Name);
+    if(!F)
+        return nullptr;
+
+    std::lock_guard<std::mutex> Lock(WriteMutex);
+    auto Next = std::make_unique<Snapshot>(*Live);
+    (*Next)[F->Name] = F.get();
+
+    Functions.push_back(std::move(F));
+    Retired.push_back(std::move(Live));
+    Live = std::move(Next);
+    Current.store(Live.get());
+
+    // Readers that arrive from here on find the new snapshot; a replaced one
+    // can go unless a reader has it marked.
+    std::set<const void *> InUse;
+    for(HazardSlot *S = HazardSlots.load(std::memory_order_acquire); S; S = S->Next)
+        if(const void *P = S->Protected.load())
+            InUse.insert(P);
+    Retired.erase(std::remove_if(Retired.begin(), Retired.end(),
+                                 [&](const std::unique_ptr<const Snapshot> &R) { return !InUse.count(R.get()); }),
+                  Retired.end());
+    return Functions.back().get();
+}
@@ -0,0 +1,55 @@
+/// Embedding API: compile Kaleidoscope definitions in-process once and run
+/// them natively, one call at a time or over whole columns of inputs.
+
+
+typedef void (*BatchFunction)(const double *const *Columns, double *Out, uint64_t NumRows);
+
+
+struct CompiledFunction {
+    std::string Name;
+    unsigned NumArgs;
+
+    // The function itself, typed as its prototype declares: double(double...)
+    // unless the arguments or result are annotated.
+    uint64_t Address;
+
+    // Out[i] = Name(Columns[0][i], ..., Columns[NumArgs-1][i]) for every row.
+    BatchFunction Batch;
+
+    template <typename FnT> FnT *get() const {
+        return reinterpret_cast<FnT *>(Address);
+    }
+};
+
+
+bool InitializeEngine();
+
+/// CompileFunction - safe to call from any thread; compilations run one at
+/// a time.
+std::unique_ptr<CompiledFunction> CompileFunction(const std::string &Source, const std::string &Name = "");
+
+
+/// FunctionRegistry - compiled functions by name for a multi-threaded host.
+/// lookup() never blocks: it reads an immutable snapshot through one atomic
+/// load, so evaluation threads keep running while compile() builds and
+/// publishes the next snapshot. Each reading thread marks the snapshot it is
+/// in with a hazard pointer of its own, and compile() frees every replaced
+/// snapshot that no thread has marked, so at most one per reader is kept.
+/// Recompiling a name publishes the new code; callers still running the old
+/// code are unaffected since compiled code is never released: each
+/// compile's JITDylib stays in the JIT for the life of the process.
+class FunctionRegistry {
+    typedef std::unordered_map<std::string, const CompiledFunction *> Snapshot;
+
+    std::atomic<const Snapshot *> Current;
+    std::mutex WriteMutex;
+    std::unique_ptr<const Snapshot> Live;
+    std::vector<std::unique_ptr<const Snapshot>> Retired;
+    std::vector<std::unique_ptr<CompiledFunction>> Functions;
+
+    public:
+    FunctionRegistry();
+
+    const CompiledFunction *lookup(const std::string &Name) const;
+    const CompiledFunction *compile(const std::string &Source, const std::string &Name = "");
+};
@@ -0,0 +1,327 @@
+static cl::opt<bool> UseFlatAST("flat-ast",
+                                cl::desc("Generate code for -load-ast straight from the flat node array, "
+                                         "skipping the AST optimizer"));
+static cl::opt<unsigned> BenchASTWalks("bench-ast", cl::init(0),
+                                       cl::desc("Time N walks of the input over the pointer and the flat AST"),
+                                       cl::value_desc("N"));
+
+
+/// FlatCodegen - IR generation over the node array of an ASTFile. Each node
+/// is one switch case rather than a virtual call, and children are found by
+/// index; the lowering itself is IRgen's, shared with the pointer AST. The
+/// file records no source locations, so -g describes functions and
+/// variables without lines, as it does for -load-ast.
+class FlatCodegen {
+    const ASTFile &File;
+
+    uint32_t getSubtreeBegin(uint32_t Id) const;
+    bool isAssignedIn(uint32_t Id, StringRef Name) const;
+    bool isIntLiteral(uint32_t Id) const;
+    void collectEffects(uint32_t Id, std::set<std::string> &Callees, bool &HasLoop, bool &HasParallelLoop) const;
+
+    Value *emitFor(const ASTNode &N);
+    Value *emitVar(const ASTNode &N);
+
+    public:
+    explicit FlatCodegen(const ASTFile &File) : File(File) {}
+    Value *emit(uint32_t Id);
+    const FunctionEffects &analyzeEffects(uint32_t i, PrototypeAST &Proto, std::string &Culprit) const;
+    Function *emitFunction(uint32_t i);
+};
+
+
+/// getSubtreeBegin - children are written right before their parent, so the
+/// subtree at Id starts at its leftmost leaf.
+uint32_t FlatCodegen::getSubtreeBegin(uint32_t Id) const {
+    while(true) {
+        const ASTNode &N = File.getNode(Id);
+        if(N.NumChildren == 0)
+            return Id;
+        Id = File.getChild(N, 0);
+    }
+}
+
+
+/// isAssignedIn - the flat IsAssignedIn: a linear scan of the subtree.
+bool FlatCodegen::isAssignedIn(uint32_t Id, StringRef Name) const {
+    for(uint32_t i = getSubtreeBegin(Id); i <= Id; ++i) {
+        const ASTNode &N = File.getNode(i);
+        switch(N.Kind) {
+            case node_binary:
+                if(N.Op == '=' && File.getString(File.getNode(File.getChild(N, 0)).Name) == Name)
+                    return true;
+                break;
+            case node_for:
+            case node_binding:
+                if(File.getString(N.Name) == Name)
+                    return true;
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+
+bool FlatCodegen::isIntLiteral(uint32_t Id) const {
+    const ASTNode &N = File.getNode(Id);
+    return N.Kind == node_number && N.Op;
+}
+
+
+/// collectEffects - the flat CollectCallees and Contains: what the subtree at
+/// Id calls and whether it loops.
+void FlatCodegen::collectEffects(uint32_t Id, std::set<std::string> &Callees, bool &HasLoop,
+                                 bool &HasParallelLoop) const {
+    const ASTNode &N = File.getNode(Id);
+    switch(N.Kind) {
+        case node_unary:
+            Callees.insert(std::string("unary") + (char)N.Op);
+            break;
+        case node_binary:
+            if(N.Op != '=' && !IsBuiltinBinaryOp(N.Op))
+                Callees.insert(std::string("binary") + (char)N.Op);
+            break;
+        case node_call:
+        case node_await:
+            Callees.insert(File.getString(N.Name).str());
+            break;
+        case node_for:
+            HasLoop = true;
+            HasParallelLoop |= (N.Op & 0x80) != 0;
+            break;
+        default:
+            break;
+    }
+
+    for(uint32_t c = 0; c != N.NumChildren; ++c)
+        if(File.getChild(N, c) != NoNode)
+            collectEffects(File.getChild(N, c), Callees, HasLoop, HasParallelLoop);
+}
+
+
+/// analyzeEffects - the flat FunctionAST::analyzeEffects for function record
+/// i, whose prototype is Proto.
+const FunctionEffects &FlatCodegen::analyzeEffects(uint32_t i, PrototypeAST &Proto, std::string &Culprit) const {
+    const ASTFunction &F = File.getFunction(i);
+    std::set<std::string> Callees;
+    bool HasLoop = false, HasParallelLoop = false;
+    collectEffects(F.Body, Callees, HasLoop, HasParallelLoop);
+    return AnalyzeEffects(Proto, F.IsMemo, Callees, HasLoop, HasParallelLoop, Culprit);
+}
+
+
+Value *FlatCodegen::emit(uint32_t Id) {
+    const ASTNode &N = File.getNode(Id);
+    auto Kid = [&](unsigned i) { return emit(File.getChild(N, i)); };
+
+    switch(N.Kind) {
+        case node_number:
+            return ConstantFP::get(*TheContext, APFloat(File.getConstant(N.Name)));
+
+        case node_variable:
+            return EmitVariable(File.getString(N.Name).str(), SourceLocation());
+
+        case node_unary:
+            return EmitUnary(N.Op, SourceLocation(), [&] { return Kid(0); });
+
+        case node_binary:
+            if(N.Op == '=')
+                return EmitAssignment(File.getString(File.getNode(File.getChild(N, 0)).Name).str(), SourceLocation(),
+                                      [&] { return Kid(1); });
+            return EmitBinary(N.Op, SourceLocation(), [&] { return Kid(0); }, isIntLiteral(File.getChild(N, 0)),
+                              [&] { return Kid(1); }, isIntLiteral(File.getChild(N, 1)));
+
+        case node_call:
+        case node_await:
+            return EmitCallExpr(File.getString(N.Name).str(), N.Kind == node_await, SourceLocation(), N.NumChildren,
+                                Kid);
+
+        case node_if:
+            return EmitIf(SourceLocation(), [&] { return Kid(0); }, [&] { return Kid(1); }, [&] { return Kid(2); });
+
+        case node_for:
+            return emitFor(N);
+        case node_var:
+            return emitVar(N);
+        case node_binding:
+            break;
+    }
+    return LogErrorV(SourceLocation(), "unexpected node in flat AST");
+}
+
+
+Value *FlatCodegen::emitFor(const ASTNode &N) {
+    std::string VarName = File.getString(N.Name).str();
+    uint32_t Step = File.getChild(N, 2), Body = File.getChild(N, 3);
+
+    auto StepFn = [&] { return emit(Step); };
+    return EmitFor(VarName, SourceLocation(), N.Op & 0x7f, N.Op & 0x80, [&] { return emit(File.getChild(N, 0)); },
+                   [&] { return emit(File.getChild(N, 1)); }, Step == NoNode ? EmitFn() : EmitFn(StepFn),
+                   Step != NoNode && isIntLiteral(Step), [&] { return emit(Body); },
+                   [&] { return isAssignedIn(Body, VarName); });
+}
+
+
+Value *FlatCodegen::emitVar(const ASTNode &N) {
+    unsigned NumVars = N.NumChildren - 1;
+    uint32_t Body = File.getChild(N, NumVars);
+
+    std::vector<std::string> Names;
+    for(unsigned i = 0; i != NumVars; ++i)
+        Names.push_back(File.getString(File.getNode(File.getChild(N, i)).Name).str());
+
+    auto Init = [&](unsigned i) -> Value * {
+        const ASTNode &B = File.getNode(File.getChild(N, i));
+        if(B.NumChildren)
+            return emit(File.getChild(B, 0));
+        return ConstantFP::get(*TheContext, APFloat(0.0));
+    };
+    auto AssignedLater = [&](unsigned i) {
+        if(isAssignedIn(Body, Names[i]))
+            return true;
+        for(unsigned j = i + 1; j != NumVars; ++j) {
+            const ASTNode &Later = File.getNode(File.getChild(N, j));
+            if(Later.NumChildren && isAssignedIn(File.getChild(Later, 0), Names[i]))
+                return true;
+        }
+        return false;
+    };
+    return EmitVar(SourceLocation(), Names, Init, AssignedLater, [&] { return emit(Body); });
+}
+
+
+/// emitFunction - the flat FunctionAST::codegen for function record i.
+Function *FlatCodegen::emitFunction(uint32_t i) {
+    const ASTFunction &F = File.getFunction(i);
+    auto Proto = File.getPrototype(i);
+    if(F.Body == NoNode) {
+        Proto->forgetEffects();
+        FunctionProtos[Proto->getName()] = std::move(Proto);
+        return nullptr;
+    }
+
+    std::string Culprit;
+    auto &Effects = analyzeEffects(i, *Proto, Culprit);
+    if(F.IsMemo && !CheckMemoEffects(SourceLocation(), Effects, Proto->isAsync(), Culprit))
+        return nullptr;
+    return EmitFunction(std::move(Proto), F.IsMemo, SourceLocation(), [&] { return emit(F.Body); });
+}
+
+
+/// CodegenFlatASTFile - CodegenASTFile without building ExprAST objects.
+static bool CodegenFlatASTFile(StringRef Filename) {
+    auto File = ASTFile::open(Filename);
+    if(!File)
+        return false;
+
+    FlatCodegen CG(*File);
+    for(uint32_t i = 0, e = File->getNumFunctions(); i != e; ++i)
+        CG.emitFunction(i);
+    return true;
+}
+
+
+static double SumConstants(ExprAST *E, unsigned &Nodes) {
+    std::vector<std::unique_ptr<ExprAST> *> Children;
+    E->getChildren(Children);
+
+    double Sum = 0, V;
+    if(E->getConstant(V))
+        Sum = V;
+    ++Nodes;
+    for(auto *Child : Children)
+        Sum += SumConstants(Child->get(), Nodes);
+    return Sum;
+}
+
+
+static double SumConstants(const ASTFile &File, uint32_t Id, unsigned &Nodes) {
+    const ASTNode &N = File.getNode(Id);
+    double Sum = N.Kind == node_number ? File.getConstant(N.Name) : 0;
+    Nodes += N.Kind != node_binding;
+    for(unsigned i = 0; i != N.NumChildren; ++i)
+        if(File.getChild(N, i) != NoNode)
+            Sum += SumConstants(File, File.getChild(N, i), Nodes);
+    return Sum;
+}
+
+
+/// BenchmarkASTWalks - parse stdin, then time the same walk (count the nodes
+/// and sum the constants) over the pointer tree, recursively over the flat
+/// array, and as one linear pass over the flat array.
+static bool BenchmarkASTWalks() {
+    std::vector<std::unique_ptr<FunctionAST>> Functions;
+    getNextToken();
+    while(CurTok != tok_eof && !ErrorLimitReached()) {
+        if(CurTok == ';') {
+            getNextToken();
+            continue;
+        }
+        if(CurTok == tok_extern) {
+            if(!ParseExtern())
+                SynchronizeParser();
+            continue;
+        }
+
+        auto FnAST = CurTok == tok_def ? ParseDefinition() : ParseTopLevelExpr();
+        if(FnAST)
+            Functions.push_back(std::move(FnAST));
+        else
+            SynchronizeParser();
+    }
+
+    ASTWriter W;
+    for(auto &Fn : Functions)
+        Fn->serialize(W);
+    SmallString<0> Data;
+    raw_svector_ostream OS(Data);
+    W.write(OS);
+    auto File = ASTFile::create(MemoryBuffer::getMemBufferCopy(Data, "<flat AST>"));
+    if(!File)
+        return false;
+
+    std::vector<ExprAST *> TreeRoots;
+    for(auto &Fn : Functions)
+        TreeRoots.push_back(Fn->getBody());
+    std::vector<uint32_t> FlatRoots;
+    for(uint32_t i = 0, e = File->getNumFunctions(); i != e; ++i)
+        if(File->getFunction(i).Body != NoNode)
+            FlatRoots.push_back(File->getFunction(i).Body);
+
+    auto Time = [&](const char *Name, function_ref<double(unsigned &)> Walk) {
+        unsigned Nodes = 0;
+        double Sum = 0;
+        auto Start = std::chrono::steady_clock::now();
+        for(unsigned i = 0; i != BenchASTWalks; ++i)
+            Sum += Walk(Nodes);
+        std::chrono::duration<double, std::nano> Elapsed = std::chrono::steady_clock::now() - Start;
+        outs() << format("%-16s %8.2f ns/node  (%u nodes, checksum %g)\n", Name,
+                         Nodes ? Elapsed.count() / Nodes : 0.0, Nodes / BenchASTWalks, Sum);
+    };
+
+    Time("pointer tree", [&](unsigned &Nodes) {
+        double Sum = 0;
+        for(auto *Root : TreeRoots)
+            Sum += SumConstants(Root, Nodes);
+        return Sum;
+    });
+    Time("flat, recursive", [&](unsigned &Nodes) {
+        double Sum = 0;
+        for(uint32_t Root : FlatRoots)
+            Sum += SumConstants(*File, Root, Nodes);
+        return Sum;
+    });
+    Time("flat, linear", [&](unsigned &Nodes) {
+        double Sum = 0;
+        for(uint32_t i = 0, e = File->getNumNodes(); i != e; ++i) {
+            const ASTNode &N = File->getNode(i);
+            if(N.Kind == node_number)
+                Sum += File->getConstant(N.Name);
+            Nodes += N.Kind != node_binding;
+        }
+        return Sum;
+    });
+    return true;
+}
@@ -1,12 +1,114 @@
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<IRBuilder<>> Builder;
 static std::unique_ptr<Module> TheModule;
 static std::map<std::string, AllocaInst *> NamedValues;
 static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
 
-Value *LogErrorV(const char *Str) {
-    LogError(Str);
+static cl::opt<bool> EmitDebugInfo("g", cl::desc("Emit DWARF debug info and register JIT'd code with gdb and perf"));
+
+// Debug info for the current module, or null without -g. Scopes holds the
+// function being generated and the var and for expressions inside it.
+static std::unique_ptr<DIBuilder> DBuilder;
+static DICompileUnit *TheCU;
+static std::vector<DIScope *> DebugScopes;
+
+
+static cl::opt<bool> Instrument("instrument",
+                                cl::desc("Count calls, cycles, branches and loop trips of each function, "
+                                         "report them at exit and write a profile for -profile-use"));
+static cl::opt<std::string> ProfileUse("profile-use",
+                                       cl::desc("Weight branches and functions with a profile from -instrument"),
+                                       cl::value_desc("filename"));
+
+/// ProfileSite - an if ('I') or for loop ('L') of the function being
+/// generated, in codegen order. Each has two counters: the entries into the
+/// then and else arms, or the trips and exits of the loop.
+struct ProfileSite {
+    char Kind;
+    BranchInst *Branch;
+};
+
+static std::vector<ProfileSite> ProfileSites;
+
+// With -instrument, the counters of the function being generated (see
+// __kaleidoscope_profile_counters in Lib.cpp), the call that fetches them
+// and the cycle count at entry.
+static Value *ProfileCounters;
+static CallInst *ProfileFetch;
+static Value *ProfileStart;
+
+/// FunctionProfile - the counters -profile-use read for one function: calls,
+/// cycles, then two per site.
+struct FunctionProfile {
+    std::string Sites;
+    std::vector<uint64_t> Counters;
+};
+
+static std::multimap<std::string, FunctionProfile> LoadedProfile;
+static std::unique_ptr<ProfileSummary> LoadedSummary;
+
+
+static cl::opt<bool> EnableFastMath("fast-math",
+                                    cl::desc("Allow reassociation, contraction and other unsafe FP math"));
+static cl::opt<FPOpFusion::FPOpFusionMode> FPContract(
+    "ffp-contract", cl::desc("Form fused FP ops (e.g. FMAs)"),
+    cl::init(FPOpFusion::Standard),
+    cl::values(clEnumValN(FPOpFusion::Fast, "fast", "Fuse FP ops whenever profitable"),
+               clEnumValN(FPOpFusion::Standard, "on", "Only fuse FP ops allowed by the language"),
+               clEnumValN(FPOpFusion::Strict, "off", "Never fuse FP ops")));
+
+
+static FPOpFusion::FPOpFusionMode GetFPOpFusionMode() {
+    return EnableFastMath ? FPOpFusion::Fast : FPContract;
+}
+
+
+static FastMathFlags GetFastMathFlags() {
+    FastMathFlags FMF;
+    if(EnableFastMath)
+        FMF.setFast();
+    if(GetFPOpFusionMode() == FPOpFusion::Fast)
+        FMF.setAllowContract(true);
+    return FMF;
+}
+
+
+/// SetFPFunctionAttributes - record the FP mode on F so the backend (and an
+/// LTO link that only sees bitcode) honours it per function.
+static void SetFPFunctionAttributes(Function *F) {
+    if(!EnableFastMath)
+        return;
+
+    F->addFnAttr("unsafe-fp-math", "true");
+    F->addFnAttr("no-infs-fp-math", "true");
+    F->addFnAttr("no-nans-fp-math", "true");
+    F->addFnAttr("no-signed-zeros-fp-math", "true");
+    F->addFnAttr("approx-func-fp-math", "true");
+}
+
+
+/// SetInferredAttributes - what the effects of P's definition prove about
+/// F. Declarations of functions defined in another module get them too, so
+/// calls are CSE'd and hoisted across JIT modules. Nothing unwinds through
+/// Kaleidoscope code or the C functions it calls.
+static void SetInferredAttributes(Function *F, const PrototypeAST &P) {
+    F->setDoesNotThrow();
+
+    auto *Effects = P.getEffects();
+    if(!Effects)
+        return;
+    if(Effects->ReadNone && !Instrument)
+        F->setDoesNotAccessMemory();
+    if(Effects->WillReturn)
+        F->addFnAttr(Attribute::WillReturn);
+}
+
+
+/// LogErrorV - a codegen error in the expression at Loc. With -pipeline,
+/// codegen runs while the parser moves on, so CurLoc is no use here.
+Value *LogErrorV(SourceLocation Loc, const char *Str) {
+    ReportError(Loc, Str);
     return nullptr;
 }
 
@@ -23,139 +125,1106 @@ Function *getFunction(std::string Name) {
 }
 
 
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName) {
+static Type *getLLVMType(ExprType Ty) {
+    switch(Ty) {
+        case type_int:
+            return Type::getInt64Ty(*TheContext);
+        case type_bool:
+            return Type::getInt1Ty(*TheContext);
+        default:
+            return Type::getDoubleTy(*TheContext);
+    }
+}
+
+
+/// ConvertTo - coerce V, an i1, i64 or double, to Ty. Bools widen to 0/1 and
+/// numbers narrow to bool with '!= 0', as conditions always have.
+static Value *ConvertTo(Value *V, Type *Ty, const Twine &Name = "") {
+    Type *From = V->getType();
+    if(From == Ty)
+        return V;
+
+    if(Ty->isIntegerTy(1)) {
+        if(From->isDoubleTy())
+            return Builder->CreateFCmpONE(V, ConstantFP::get(*TheContext, APFloat(0.0)), Name);
+        return Builder->CreateICmpNE(V, ConstantInt::get(From, 0), Name);
+    }
+
+    if(Ty->isIntegerTy()) {
+        if(From->isDoubleTy())
+            return Builder->CreateFPToSI(V, Ty, Name);
+        return Builder->CreateZExt(V, Ty, Name);
+    }
+
+    if(From->isIntegerTy(1))
+        return Builder->CreateUIToFP(V, Ty, Name);
+    return Builder->CreateSIToFP(V, Ty, Name);
+}
+
+
+/// JoinTypes - the narrowest type both A and B convert to without losing
+/// their value: bool < int < double.
+static Type *JoinTypes(Type *A, Type *B) {
+    if(A == B)
+        return A;
+    if(A->isDoubleTy() || B->isDoubleTy())
+        return Type::getDoubleTy(*TheContext);
+    return Type::getInt64Ty(*TheContext);
+}
+
+
+static Value *EmitCondition(Value *V, const Twine &Name) {
+    return ConvertTo(V, Type::getInt1Ty(*TheContext), Name);
+}
+
+
+/// EmitBuiltinBinOp - lower one of the builtin operators, staying in integer
+/// arithmetic while both sides are integers or bools. Returns null for
+/// operators that have to be looked up as user functions.
+static Value *EmitBuiltinBinOp(char Op, Value *L, Value *R) {
+    if(Op != '+' && Op != '-' && Op != '*' && Op != '<')
+        return nullptr;
+
+    Type *Ty = JoinTypes(JoinTypes(L->getType(), R->getType()), Type::getInt64Ty(*TheContext));
+    L = ConvertTo(L, Ty);
+    R = ConvertTo(R, Ty);
+
+    if(Ty->isIntegerTy()) {
+        switch(Op) {
+            case '+':
+                return Builder->CreateAdd(L, R, "addtmp");
+            case '-':
+                return Builder->CreateSub(L, R, "subtmp");
+            case '*':
+                return Builder->CreateMul(L, R, "multmp");
+            default:
+                return Builder->CreateICmpSLT(L, R, "cmptmp");
+        }
+    }
+
+    switch(Op) {
+        case '+':
+            return Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder->CreateFMul(L, R, "multmp");
+        default:
+            return Builder->CreateFCmpULT(L, R, "cmptmp");
+    }
+}
+
+
+/// AdoptIntLiteral - V, the value of an operand; an integer literal takes
+/// the integer type of the Other side. Anywhere else literals are doubles, so
+/// arithmetic on unannotated values never wraps.
+static Value *AdoptIntLiteral(Value *V, bool IsIntLiteral, Value *Other) {
+    if(IsIntLiteral && Other->getType()->isIntegerTy())
+        return ConvertTo(V, Type::getInt64Ty(*TheContext));
+    return V;
+}
+
+
+/// EmitCall - call F, converting each argument to the parameter type.
+static Value *EmitCall(Function *F, ArrayRef<Value *> Args, const Twine &Name) {
+    std::vector<Value *> ArgsV;
+    for(unsigned i = 0, e = Args.size(); i != e; ++i)
+        ArgsV.push_back(ConvertTo(Args[i], F->getFunctionType()->getParamType(i)));
+    return Builder->CreateCall(F, ArgsV, Name);
+}
+
+
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName, Type *Ty) {
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), nullptr, VarName);
+    return TmpB.CreateAlloca(Ty, nullptr, VarName);
 }
 
 
-Value *NumberExprAST::codegen() {
-    return ConstantFP::get(TheContext, APFloat(Val));
+/// InitializeDebugInfo - start debug info for TheModule when -g is given.
+static void InitializeDebugInfo() {
+    DBuilder.reset();
+    DebugScopes.clear();
+    if(!EmitDebugInfo)
+        return;
+
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    TheModule->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    DBuilder = std::make_unique<DIBuilder>(*TheModule);
+    TheCU = DBuilder->createCompileUnit(dwarf::DW_LANG_C, DBuilder->createFile("<stdin>", "."),
+                                        "Kaleidoscope Compiler", false, "", 0);
 }
 
 
-Value *VariableExprAST::codegen() {
-    Value *V = NamedValues[Name];
-    if(!V)
-        return LogErrorV("Unknown variable name");
+/// FinalizeDebugInfo - resolve the debug info of TheModule before it is
+/// handed to the optimizer, the JIT or another thread.
+static void FinalizeDebugInfo() {
+    if(DBuilder)
+        DBuilder->finalize();
+}
+
 
-    return Builder.CreateLoad(V, Name.c_str());
+static DIType *GetDebugType(Type *Ty) {
+    if(Ty->isIntegerTy(1))
+        return DBuilder->createBasicType("bool", 8, dwarf::DW_ATE_boolean);
+    if(Ty->isIntegerTy())
+        return DBuilder->createBasicType("int", 64, dwarf::DW_ATE_signed);
+    return DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
 }
 
 
-Value *UnaryExprAST::codegen() {
-    Value *OperandV = Operand->codegen();
-    if(!OperandV)
+/// EmitLocation - attach Loc to the instructions built from here on.
+static void EmitLocation(SourceLocation Loc) {
+    if(!DBuilder || DebugScopes.empty())
+        return;
+    DIScope *Scope = DebugScopes.back();
+    Builder->SetCurrentDebugLocation(DILocation::get(Scope->getContext(), Loc.Line, Loc.Col, Scope));
+}
+
+
+static void EmitLocation(const ExprAST *E) {
+    EmitLocation(E->getLoc());
+}
+
+
+/// CreateDebugFunction - describe F, defined at Loc, and make it the
+/// current scope. The prologue is left without a location.
+static DISubprogram *CreateDebugFunction(Function *F, SourceLocation Loc) {
+    if(!DBuilder)
         return nullptr;
 
-    Function *F = getFunction(std::string("unary") + Opcode);
-    if(!F)
-        return LogErrorV("Unknown unary operator");
+    SmallVector<Metadata *, 8> Types;
+    Types.push_back(GetDebugType(F->getReturnType()));
+    for(auto &Arg : F->args())
+        Types.push_back(GetDebugType(Arg.getType()));
+
+    DISubprogram *SP = DBuilder->createFunction(
+        TheCU->getFile(), F->getName(), StringRef(), TheCU->getFile(), Loc.Line,
+        DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(Types)), Loc.Line,
+        DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    F->setSubprogram(SP);
+    DebugScopes.assign(1, SP);
+    Builder->SetCurrentDebugLocation(DebugLoc());
+    return SP;
+}
+
 
-    return Builder.CreateCall(F, OperandV, "unop");
+/// PushDebugScope - open a lexical block at Loc for the variables a var or
+/// for expression binds.
+static void PushDebugScope(SourceLocation Loc) {
+    if(DBuilder && !DebugScopes.empty())
+        DebugScopes.push_back(DBuilder->createLexicalBlock(DebugScopes.back(), TheCU->getFile(), Loc.Line, Loc.Col));
 }
 
 
-Value *BinaryExprAST::codegen() {
-    if(Op == '=') {
-        VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-        if(!LHSE)
-            return LogErrorV("destination of '=' must be a variable");
+static void PopDebugScope() {
+    if(DBuilder && DebugScopes.size() > 1)
+        DebugScopes.pop_back();
+}
+
+
+/// DeclareVariable - tell the debugger that Name lives in Alloca. ArgNo is
+/// the 1-based parameter number, or 0 for a local.
+static void DeclareVariable(AllocaInst *Alloca, StringRef Name, SourceLocation Loc, unsigned ArgNo = 0) {
+    if(!DBuilder || DebugScopes.empty())
+        return;
+
+    DIScope *Scope = DebugScopes.back();
+    DIType *Ty = GetDebugType(Alloca->getAllocatedType());
+    DILocalVariable *Var =
+        ArgNo ? DBuilder->createParameterVariable(Scope, Name, ArgNo, TheCU->getFile(), Loc.Line, Ty, true)
+              : DBuilder->createAutoVariable(Scope, Name, TheCU->getFile(), Loc.Line, Ty, true);
+    DBuilder->insertDeclare(Alloca, Var, DBuilder->createExpression(),
+                            DILocation::get(Scope->getContext(), Loc.Line, Loc.Col, Scope),
+                            Builder->GetInsertBlock());
+}
+
+
+/// EmitProfileAdd - add Delta to the counter at Slot. parfor bodies and
+/// concurrent callers of the same function bump the same counters, so the
+/// add is atomic; it needs no ordering with anything else.
+static void EmitProfileAdd(Value *Slot, Value *Delta) {
+    Builder->CreateAtomicRMW(AtomicRMWInst::Add, Slot, Delta, MaybeAlign(8), AtomicOrdering::Monotonic);
+}
+
+
+/// EmitProfileEntry - fetch F's counters, from the runtime on its first call
+/// and from a cache after that, count the call and start its timer.
+static void EmitProfileEntry(Function *F) {
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    PointerType *CountersTy = Int64Ty->getPointerTo();
+    auto *Cache = new GlobalVariable(*TheModule, CountersTy, false, GlobalValue::InternalLinkage,
+                                     ConstantPointerNull::get(CountersTy), F->getName() + ".prof");
+    FunctionCallee Fetch = TheModule->getOrInsertFunction("__kaleidoscope_profile_counters", CountersTy,
+                                                          Builder->getInt8PtrTy(), Builder->getInt8PtrTy());
+
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *FetchBB = BasicBlock::Create(*TheContext, "prof.fetch", F);
+    BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "prof.body", F);
+    // Callers on other threads may race to fill the cache; they all get
+    // the same counters back from the runtime.
+    LoadInst *Cached = Builder->CreateLoad(CountersTy, Cache, "prof.cached");
+    Cached->setAtomic(AtomicOrdering::Monotonic);
+    Builder->CreateCondBr(Builder->CreateIsNull(Cached), FetchBB, BodyBB,
+                          MDBuilder(*TheContext).createBranchWeights(1, 1 << 20));
+
+    // The site list is filled in once the body has been generated.
+    Builder->SetInsertPoint(FetchBB);
+    ProfileFetch = Builder->CreateCall(Fetch, {Builder->CreateGlobalStringPtr(F->getName()),
+                                               ConstantPointerNull::get(Builder->getInt8PtrTy())});
+    Builder->CreateStore(ProfileFetch, Cache)->setAtomic(AtomicOrdering::Monotonic);
+    Builder->CreateBr(BodyBB);
+
+    Builder->SetInsertPoint(BodyBB);
+    PHINode *Counters = Builder->CreatePHI(CountersTy, 2, "prof.counters");
+    Counters->addIncoming(Cached, EntryBB);
+    Counters->addIncoming(ProfileFetch, FetchBB);
+    ProfileCounters = Counters;
+
+    EmitProfileAdd(Counters, Builder->getInt64(1));
+    ProfileStart = Builder->CreateCall(Intrinsic::getDeclaration(TheModule.get(), Intrinsic::readcyclecounter), {},
+                                       "prof.start");
+}
+
+
+static std::string GetProfileSites() {
+    std::string Sites;
+    for(auto &Site : ProfileSites)
+        Sites += Site.Kind;
+    return Sites;
+}
+
+
+/// EmitProfileExit - add the cycles since entry to the function's total.
+static void EmitProfileExit() {
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Value *End = Builder->CreateCall(Intrinsic::getDeclaration(TheModule.get(), Intrinsic::readcyclecounter), {},
+                                     "prof.end");
+    Value *Slot = Builder->CreateConstInBoundsGEP1_64(Int64Ty, ProfileCounters, 1);
+    EmitProfileAdd(Slot, Builder->CreateSub(End, ProfileStart));
+    ProfileFetch->setArgOperand(1, Builder->CreateGlobalStringPtr(GetProfileSites()));
+}
+
+
+/// AddProfileSite - number the next if or loop of the function.
+static unsigned AddProfileSite(char Kind) {
+    ProfileSites.push_back({Kind, nullptr});
+    return ProfileSites.size() - 1;
+}
 
-        Value *Val = RHS->codegen();
-        if(!Val)
-            return nullptr;
 
-        Value *VariableExprAST = NamedValues[LHSE->getName()];
-        if(!Variable)
-            return LogErrorV("Unknown variable name");
+/// EmitProfileCount - with -instrument, bump counter Which (0 or 1) of Site.
+static void EmitProfileCount(unsigned Site, unsigned Which) {
+    if(!ProfileCounters)
+        return;
 
-        Builder.CreateStore(Val, Variable);
-        return Val;
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Value *Slot = Builder->CreateConstInBoundsGEP1_64(Int64Ty, ProfileCounters, 2 + 2 * Site + Which);
+    EmitProfileAdd(Slot, Builder->getInt64(1));
+}
+
+
+/// LoadProfile - read the -profile-use file an -instrument build wrote: one
+/// line per function with its name, its sites ("-" for none) and counters.
+static bool LoadProfile() {
+    auto Buffer = MemoryBuffer::getFile(ProfileUse);
+    if(!Buffer) {
+        errs() << "Could not open " << ProfileUse << ": " << Buffer.getError().message() << "\n";
+        return false;
     }
 
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if(!L || !R)
-        return nullptr;
+    InstrProfSummaryBuilder Summary(ProfileSummaryBuilder::DefaultCutoffs);
+    for(line_iterator Line(**Buffer, true, '#'); !Line.is_at_eof(); ++Line) {
+        SmallVector<StringRef, 16> Fields;
+        Line->split(Fields, ' ', -1, false);
 
-    switch(Op) {
-        case '+':
-            return Builder.CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder.CreateFSub(L, R, "subtmp");
+        FunctionProfile P;
+        bool OK = Fields.size() >= 4;
+        if(OK) {
+            P.Sites = Fields[1] == "-" ? "" : Fields[1].str();
+            OK = Fields.size() == 4 + 2 * P.Sites.size();
+        }
+        for(unsigned i = 2; OK && i != Fields.size(); ++i) {
+            P.Counters.push_back(0);
+            OK = !Fields[i].getAsInteger(10, P.Counters.back());
+        }
+        if(!OK) {
+            errs() << ProfileUse << ":" << Line.line_number() << ": malformed profile entry\n";
+            return false;
+        }
+
+        // The summary takes the first count as the entry count; cycles are
+        // not execution counts.
+        std::vector<uint64_t> Counts(P.Counters.begin(), P.Counters.end());
+        Counts.erase(Counts.begin() + 1);
+        Summary.addRecord(InstrProfRecord(std::move(Counts)));
+        LoadedProfile.insert({Fields[0].str(), std::move(P)});
+    }
+
+    LoadedSummary = Summary.getSummary();
+    return true;
+}
+
+
+/// SetProfileSummary - give TheModule the summary of the loaded profile, which
+/// the inliner and block placement consult to tell hot code from cold.
+static void SetProfileSummary() {
+    if(LoadedSummary)
+        TheModule->setProfileSummary(LoadedSummary->getMD(*TheContext), ProfileSummary::PSK_Instr);
+}
+
+
+/// GetBranchWeights - branch weights for the counts A and B, scaled down
+/// to fit in 32 bits.
+static MDNode *GetBranchWeights(uint64_t A, uint64_t B) {
+    uint64_t Scale = std::max(A, B) / std::numeric_limits<uint32_t>::max() + 1;
+    return MDBuilder(*TheContext).createBranchWeights(A / Scale + 1, B / Scale + 1);
+}
+
+
+/// ApplyProfile - attach F's entry count and the weights of each of its
+/// branches from the loaded profile. Functions whose ifs and loops no longer
+/// match their profile are left alone.
+static void ApplyProfile(Function *F) {
+    auto Range = LoadedProfile.equal_range(F->getName().str());
+    std::string Sites = GetProfileSites();
+    for(auto I = Range.first; I != Range.second; ++I) {
+        const FunctionProfile &P = I->second;
+        if(P.Sites != Sites)
+            continue;
+
+        F->setEntryCount(P.Counters[0]);
+        for(unsigned i = 0; i != ProfileSites.size(); ++i) {
+            uint64_t First = P.Counters[2 + 2 * i], Second = P.Counters[3 + 2 * i];
+            // A loop branches back on every trip but the last of each run.
+            if(ProfileSites[i].Kind == 'L')
+                First = First > Second ? First - Second : 0;
+            ProfileSites[i].Branch->setMetadata(LLVMContext::MD_prof, GetBranchWeights(First, Second));
+        }
+        return;
+    }
+}
+
+
+static cl::opt<unsigned> MemoCacheBits("memo-cache-bits", cl::init(12),
+                                       cl::desc("Give each memo function a cache of 2^N results"),
+                                       cl::value_desc("N"));
+
+// Slots a lookup tries, starting at the key's hash, before it evicts.
+static const unsigned MemoProbes = 8;
+
+
+/// ToCacheBits - V, an i1, i64 or double, as the i64 a cache entry holds.
+static Value *ToCacheBits(Value *V) {
+    if(V->getType()->isDoubleTy())
+        return Builder->CreateBitCast(V, Builder->getInt64Ty());
+    return Builder->CreateZExt(V, Builder->getInt64Ty());
+}
+
+
+static Value *FromCacheBits(Value *V, Type *Ty) {
+    if(Ty->isDoubleTy())
+        return Builder->CreateBitCast(V, Ty);
+    return Builder->CreateTrunc(V, Ty);
+}
+
+
+/// EmitMemoWrapper - make F, the definition of P, the uncached body of a
+/// memo function and give its name to a wrapper that looks the arguments up
+/// in a cache first, so that recursive calls are cached too. The cache is an
+/// open-addressed table of entries holding a version, the argument bits and
+/// the result bits. A lookup probes MemoProbes slots from the hash of the
+/// arguments; a miss fills the first empty one, or evicts the first when
+/// none is.
+///
+/// The function may be called from several threads at once, so each entry
+/// is a seqlock: the version is 0 while the entry is empty, odd while a
+/// writer fills it and even otherwise. A reader only trusts what it read
+/// between two equal even versions, and a writer that loses the race for an
+/// entry leaves it alone.
+static Function *EmitMemoWrapper(Function *F, const PrototypeAST &P) {
+    Type *Int64Ty = Builder->getInt64Ty();
+    unsigned NumArgs = F->arg_size(), Stride = NumArgs + 2;
+    unsigned Bits = std::min(std::max(1u, (unsigned)MemoCacheBits), 32u);
+    uint64_t Mask = (1ull << Bits) - 1;
+    auto *TableTy = ArrayType::get(Int64Ty, (Mask + 1) * Stride);
+    auto *Table = new GlobalVariable(*TheModule, TableTy, false, GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(TableTy), F->getName() + ".cache");
+
+    Function *Memo = Function::Create(F->getFunctionType(), F->getLinkage(), "", TheModule.get());
+    F->replaceAllUsesWith(Memo);
+    Memo->takeName(F);
+    F->setName(Memo->getName() + ".uncached");
+    F->setLinkage(Function::InternalLinkage);
+    SetFPFunctionAttributes(Memo);
+    SetInferredAttributes(Memo, P);
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", Memo);
+    BasicBlock *ProbeBB = BasicBlock::Create(*TheContext, "probe", Memo);
+    BasicBlock *CompareBB = BasicBlock::Create(*TheContext, "compare", Memo);
+    BasicBlock *HitBB = BasicBlock::Create(*TheContext, "hit", Memo);
+    BasicBlock *NextBB = BasicBlock::Create(*TheContext, "next", Memo);
+    BasicBlock *MissBB = BasicBlock::Create(*TheContext, "miss", Memo);
+
+    Builder->SetInsertPoint(EntryBB);
+    std::vector<Value *> Args, Keys;
+    Value *Hash = Builder->getInt64(0);
+    for(auto &Arg : Memo->args()) {
+        Arg.setName(F->getArg(Arg.getArgNo())->getName());
+        Args.push_back(&Arg);
+        Keys.push_back(ToCacheBits(&Arg));
+        Hash = Builder->CreateMul(Builder->CreateXor(Hash, Keys.back()), Builder->getInt64(0x9e3779b97f4a7c15ull));
+    }
+    // Doubles keep their low bits clear, so take the slot from the top bits.
+    Value *Home = Builder->CreateLShr(Hash, 64 - Bits, "home");
+    Builder->CreateBr(ProbeBB);
+
+    auto GetEntry = [&](Value *Slot) {
+        Value *Index = Builder->CreateMul(Slot, Builder->getInt64(Stride));
+        return Builder->CreateInBoundsGEP(TableTy, Table, {Builder->getInt64(0), Index}, "entry");
+    };
+
+    auto LoadEntry = [&](Value *Entry, unsigned Field, AtomicOrdering Order, const Twine &Name) {
+        LoadInst *L = Builder->CreateLoad(Int64Ty, Builder->CreateConstInBoundsGEP1_64(Int64Ty, Entry, Field), Name);
+        L->setAtomic(Order);
+        return L;
+    };
+    auto StoreEntry = [&](Value *V, Value *Entry, unsigned Field, AtomicOrdering Order) {
+        Builder->CreateStore(V, Builder->CreateConstInBoundsGEP1_64(Int64Ty, Entry, Field))->setAtomic(Order);
+    };
+
+    Builder->SetInsertPoint(ProbeBB);
+    PHINode *Probe = Builder->CreatePHI(Int64Ty, 2, "probe");
+    Probe->addIncoming(Builder->getInt64(0), EntryBB);
+    Value *Slot = Builder->CreateAnd(Builder->CreateAdd(Home, Probe), Mask, "slot");
+    Value *Entry = GetEntry(Slot);
+    Value *Version = LoadEntry(Entry, 0, AtomicOrdering::Acquire, "version");
+    Builder->CreateCondBr(Builder->CreateIsNull(Version), MissBB, CompareBB);
+
+    // An entry that is being written, or was rewritten while it was read,
+    // counts as a mismatch.
+    Builder->SetInsertPoint(CompareBB);
+    Value *Match = Builder->CreateIsNull(Builder->CreateAnd(Version, 1));
+    for(unsigned i = 0; i != NumArgs; ++i)
+        Match = Builder->CreateAnd(Match, Builder->CreateICmpEQ(LoadEntry(Entry, 1 + i, AtomicOrdering::Monotonic,
+                                                                          "key"), Keys[i]));
+    Value *Cached = LoadEntry(Entry, 1 + NumArgs, AtomicOrdering::Monotonic, "cached");
+    Builder->CreateFence(AtomicOrdering::Acquire);
+    Value *Recheck = LoadEntry(Entry, 0, AtomicOrdering::Monotonic, "recheck");
+    Match = Builder->CreateAnd(Match, Builder->CreateICmpEQ(Version, Recheck));
+    Builder->CreateCondBr(Match, HitBB, NextBB);
+
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(FromCacheBits(Cached, F->getReturnType()));
+
+    Builder->SetInsertPoint(NextBB);
+    Value *NextProbe = Builder->CreateAdd(Probe, Builder->getInt64(1));
+    Probe->addIncoming(NextProbe, NextBB);
+    Builder->CreateCondBr(Builder->CreateICmpULT(NextProbe, Builder->getInt64(MemoProbes)), ProbeBB, MissBB);
+
+    // The call may itself fill or evict entries, so the slot is only
+    // claimed once it returns.
+    Builder->SetInsertPoint(MissBB);
+    PHINode *Victim = Builder->CreatePHI(Int64Ty, 2, "victim");
+    Victim->addIncoming(Slot, ProbeBB);
+    Victim->addIncoming(Home, NextBB);
+    Value *Result = Builder->CreateCall(F, Args, "result");
+    Entry = GetEntry(Victim);
+    Value *Old = LoadEntry(Entry, 0, AtomicOrdering::Monotonic, "old");
+    Value *Claimed = Builder->CreateAtomicCmpXchg(Entry, Old, Builder->CreateOr(Old, 1), MaybeAlign(8),
+                                                  AtomicOrdering::Acquire, AtomicOrdering::Monotonic);
+    Value *Won = Builder->CreateAnd(Builder->CreateIsNull(Builder->CreateAnd(Old, 1)),
+                                    Builder->CreateExtractValue(Claimed, 1), "won");
+    BasicBlock *FillBB = BasicBlock::Create(*TheContext, "fill", Memo);
+    BasicBlock *DoneBB = BasicBlock::Create(*TheContext, "done", Memo);
+    Builder->CreateCondBr(Won, FillBB, DoneBB);
+
+    Builder->SetInsertPoint(FillBB);
+    Builder->CreateFence(AtomicOrdering::Release);
+    for(unsigned i = 0; i != NumArgs; ++i)
+        StoreEntry(Keys[i], Entry, 1 + i, AtomicOrdering::Monotonic);
+    StoreEntry(ToCacheBits(Result), Entry, 1 + NumArgs, AtomicOrdering::Monotonic);
+    StoreEntry(Builder->CreateAdd(Old, Builder->getInt64(2)), Entry, 0, AtomicOrdering::Release);
+    Builder->CreateBr(DoneBB);
+
+    Builder->SetInsertPoint(DoneBB);
+    Builder->CreateRet(Result);
+
+    verifyFunction(*Memo);
+    return Memo;
+}
+
+
+/// CoroutineState - the async function being generated: the future it
+/// returns, its frame and the blocks that free the frame and return. Handle
+/// is null outside async functions.
+struct CoroutineState {
+    Value *Id = nullptr;
+    Value *Handle = nullptr;
+    Value *Result = nullptr;
+    BasicBlock *CleanupBB = nullptr;
+    BasicBlock *SuspendBB = nullptr;
+};
+static CoroutineState Coroutine;
+
+
+/// IsAsyncFunction - whether calls to Name return a future.
+static bool IsAsyncFunction(const std::string &Name) {
+    auto I = FunctionProtos.find(Name);
+    return I != FunctionProtos.end() && I->second->isAsync();
+}
+
+
+/// BeginCoroutine - make F, whose entry block is current, a switched-resume
+/// coroutine with a heap frame. Its result future is created first, so that
+/// F can return it from the first suspension.
+static void BeginCoroutine(Function *F) {
+    Type *Int8PtrTy = Builder->getInt8PtrTy();
+    Type *Int64Ty = Builder->getInt64Ty();
+    Value *Null = ConstantPointerNull::get(Builder->getInt8PtrTy());
+
+    FunctionCallee NewFuture = TheModule->getOrInsertFunction("__kaleidoscope_future_new", Int8PtrTy);
+    FunctionCallee Malloc = TheModule->getOrInsertFunction("malloc", Int8PtrTy, Int64Ty);
+
+    // Marks F for CoroSplit, which lowers it in the optimizer.
+    F->addFnAttr("coroutine.presplit", "0");
+
+    Coroutine.Result = Builder->CreateCall(NewFuture, {}, "future");
+    Coroutine.Id = Builder->CreateIntrinsic(Intrinsic::coro_id, {}, {Builder->getInt32(0), Null, Null, Null},
+                                            nullptr, "coro.id");
+    Value *NeedAlloc = Builder->CreateIntrinsic(Intrinsic::coro_alloc, {}, {Coroutine.Id}, nullptr, "coro.needalloc");
+
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *AllocBB = BasicBlock::Create(*TheContext, "coro.alloc", F);
+    BasicBlock *BeginBB = BasicBlock::Create(*TheContext, "coro.begin", F);
+    Builder->CreateCondBr(NeedAlloc, AllocBB, BeginBB);
+
+    Builder->SetInsertPoint(AllocBB);
+    Value *Size = Builder->CreateIntrinsic(Intrinsic::coro_size, {Int64Ty}, {}, nullptr, "coro.size");
+    Value *Mem = Builder->CreateCall(Malloc, Size, "coro.mem");
+    Builder->CreateBr(BeginBB);
+
+    Builder->SetInsertPoint(BeginBB);
+    PHINode *Frame = Builder->CreatePHI(Int8PtrTy, 2, "coro.frame");
+    Frame->addIncoming(Null, EntryBB);
+    Frame->addIncoming(Mem, AllocBB);
+    Coroutine.Handle = Builder->CreateIntrinsic(Intrinsic::coro_begin, {}, {Coroutine.Id, Frame}, nullptr, "coro.hdl");
+    Coroutine.CleanupBB = BasicBlock::Create(*TheContext, "coro.cleanup");
+    Coroutine.SuspendBB = BasicBlock::Create(*TheContext, "coro.suspend");
+}
+
+
+/// EndCoroutine - resolve the coroutine's future to RetVal, free the frame
+/// and return. The ramp returns the future to the caller; the resumed parts
+/// return to the event loop.
+static void EndCoroutine(Value *RetVal) {
+    Type *Int8PtrTy = Builder->getInt8PtrTy();
+    Function *F = Builder->GetInsertBlock()->getParent();
+    FunctionCallee Resolve = TheModule->getOrInsertFunction("__kaleidoscope_future_resolve", Builder->getVoidTy(),
+                                                            Int8PtrTy, Builder->getDoubleTy());
+    FunctionCallee Free = TheModule->getOrInsertFunction("free", Builder->getVoidTy(), Int8PtrTy);
+
+    Value *Args[] = {Coroutine.Result, ConvertTo(RetVal, Builder->getDoubleTy())};
+    Builder->CreateCall(Resolve, Args);
+    Builder->CreateBr(Coroutine.CleanupBB);
+
+    F->getBasicBlockList().push_back(Coroutine.CleanupBB);
+    Builder->SetInsertPoint(Coroutine.CleanupBB);
+    Value *Mem = Builder->CreateIntrinsic(Intrinsic::coro_free, {}, {Coroutine.Id, Coroutine.Handle}, nullptr,
+                                          "coro.mem");
+    BasicBlock *FreeBB = BasicBlock::Create(*TheContext, "coro.free", F);
+    Builder->CreateCondBr(Builder->CreateIsNotNull(Mem), FreeBB, Coroutine.SuspendBB);
+    Builder->SetInsertPoint(FreeBB);
+    Builder->CreateCall(Free, Mem);
+    Builder->CreateBr(Coroutine.SuspendBB);
+
+    F->getBasicBlockList().push_back(Coroutine.SuspendBB);
+    Builder->SetInsertPoint(Coroutine.SuspendBB);
+    Builder->CreateIntrinsic(Intrinsic::coro_end, {}, {Coroutine.Handle, Builder->getFalse()});
+    Builder->CreateRet(Coroutine.Result);
+}
+
+
+/// EmitAwait - call the async function CalleeF and suspend until its future
+/// is ready, unless it already is. The result has type RetTy.
+static Value *EmitAwait(Function *CalleeF, ArrayRef<Value *> Args, Type *RetTy) {
+    Type *Int8PtrTy = Builder->getInt8PtrTy();
+    Function *F = Builder->GetInsertBlock()->getParent();
+    FunctionCallee Await = TheModule->getOrInsertFunction("__kaleidoscope_future_await", Builder->getInt32Ty(),
+                                                          Int8PtrTy, Int8PtrTy);
+    FunctionCallee Take = TheModule->getOrInsertFunction("__kaleidoscope_future_take", Builder->getDoubleTy(),
+                                                         Int8PtrTy);
+
+    Value *Future = EmitCall(CalleeF, Args, "future");
+    Value *Suspend = Builder->CreateCall(Await, {Future, Coroutine.Handle}, "mustsuspend");
+
+    BasicBlock *SuspendBB = BasicBlock::Create(*TheContext, "await.suspend", F);
+    BasicBlock *ResumeBB = BasicBlock::Create(*TheContext, "await.resume", F);
+    Builder->CreateCondBr(Builder->CreateIsNotNull(Suspend), SuspendBB, ResumeBB);
+
+    Builder->SetInsertPoint(SuspendBB);
+    Value *Token = ConstantTokenNone::get(*TheContext);
+    Value *State = Builder->CreateIntrinsic(Intrinsic::coro_suspend, {}, {Token, Builder->getFalse()}, nullptr,
+                                            "coro.state");
+    SwitchInst *Switch = Builder->CreateSwitch(State, Coroutine.SuspendBB, 2);
+    Switch->addCase(Builder->getInt8(0), ResumeBB);
+    Switch->addCase(Builder->getInt8(1), Coroutine.CleanupBB);
+
+    Builder->SetInsertPoint(ResumeBB);
+    return ConvertTo(Builder->CreateCall(Take, Future, "awaited"), RetTy);
+}
+
+
+/// EmitAsyncRunner - replace F, an async top-level expression, with a plain
+/// function of the same name that runs the event loop until F's result is
+/// in, so drivers call it like any other.
+static Function *EmitAsyncRunner(Function *F) {
+    std::string Name = F->getName().str();
+    F->setName(Name + ".async");
+    F->setLinkage(Function::InternalLinkage);
+
+    FunctionType *FT = FunctionType::get(Builder->getDoubleTy(), false);
+    Function *Runner = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    FunctionCallee Run = TheModule->getOrInsertFunction("__kaleidoscope_run", Builder->getDoubleTy(),
+                                                        Builder->getInt8PtrTy());
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Runner));
+    Builder->CreateRet(Builder->CreateCall(Run, Builder->CreateCall(F, {}, "future"), "result"));
+    verifyFunction(*Runner);
+    return Runner;
+}
+
+
+/// ParforCaptures - the copies a parfor chunk makes of the variables in scope
+/// around the loop, and its counter. Chunks run concurrently, so their bodies
+/// may read these but not assign them.
+static std::set<AllocaInst *> ParforCaptures;
+
+
+/// GetReductionIdentity - the value a Reduction starts from, and the result
+/// when the loop runs no iterations. Reductions always accumulate in double,
+/// serial or parallel, since __kaleidoscope_parfor combines its chunks'
+/// results as doubles: an integer body gives the same sum either way, and
+/// neither wraps.
+static Constant *GetReductionIdentity(char Reduction) {
+    Type *Ty = Type::getDoubleTy(*TheContext);
+    switch(Reduction) {
+        case '*':
+            return ConstantFP::get(Ty, 1.0);
+        case '<':
+            return ConstantFP::getInfinity(Ty);
+        case '>':
+            return ConstantFP::getInfinity(Ty, true);
+        default:
+            return ConstantFP::get(Ty, 0.0);
+    }
+}
+
+
+/// EmitReductionStep - Acc combined with Val. Floating-point sums and
+/// products may be reassociated, which is what lets the vectorizer keep one
+/// partial result per lane. Min and max skip NaNs, as minnum and maxnum do,
+/// so they only vectorize under -fast-math, where there are none.
+static Value *EmitReductionStep(char Reduction, Value *Acc, Value *Val) {
+    Value *Result;
+    switch(Reduction) {
         case '*':
-            return Builder.CreateFMul(L, R, "multmp");
+            Result = Builder->CreateFMul(Acc, Val, "acc");
+            break;
         case '<':
-            L = Builder.CreateFCmpULT(L, R, "cmptmp");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+            Result = Builder->CreateBinaryIntrinsic(Intrinsic::minnum, Acc, Val, nullptr, "acc");
+            break;
+        case '>':
+            Result = Builder->CreateBinaryIntrinsic(Intrinsic::maxnum, Acc, Val, nullptr, "acc");
+            break;
         default:
+            Result = Builder->CreateFAdd(Acc, Val, "acc");
             break;
     }
+    if(auto *I = dyn_cast<Instruction>(Result))
+        I->setHasAllowReassoc(true);
+    return Result;
+}
+
+
+/// EmitParallelFor - a parfor over VarName, whose iterations NumTrips are
+/// numbered from 0. EmitBody is generated into "<parent>.parfor", which
+/// combines the body over a range of iteration numbers;
+/// __kaleidoscope_parfor splits the iterations into such ranges for the
+/// runtime's threads and combines their results. The variables in scope
+/// reach the chunk through an environment.
+static Value *EmitParallelFor(const std::string &VarName, Value *StartVal, Value *StepVal, Value *NumTrips,
+                              char Reduction, SourceLocation Loc, function_ref<Value *()> EmitBody) {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Type *Int8PtrTy = Builder->getInt8PtrTy();
+    Type *VarTy = StartVal->getType();
+    Function *Parent = Builder->GetInsertBlock()->getParent();
+
+    std::vector<std::pair<std::string, AllocaInst *>> Captures;
+    std::vector<Type *> Fields = {VarTy, VarTy};
+    for(auto &Named : NamedValues)
+        if(Named.second) {
+            Captures.push_back(Named);
+            Fields.push_back(Named.second->getAllocatedType());
+        }
+    StructType *EnvTy = StructType::get(*TheContext, Fields);
+    AllocaInst *Env = CreateEntryBlockAlloca(Parent, "parfor.env", EnvTy);
+    Builder->CreateStore(StartVal, Builder->CreateStructGEP(EnvTy, Env, 0));
+    Builder->CreateStore(StepVal, Builder->CreateStructGEP(EnvTy, Env, 1));
+    for(unsigned i = 0, e = Captures.size(); i != e; ++i) {
+        AllocaInst *Var = Captures[i].second;
+        Value *Val = Builder->CreateLoad(Var->getAllocatedType(), Var, Captures[i].first);
+        Builder->CreateStore(Val, Builder->CreateStructGEP(EnvTy, Env, 2 + i));
+    }
+
+    Type *Params[] = {Int8PtrTy, Int64Ty, Int64Ty};
+    FunctionType *ChunkTy = FunctionType::get(DoubleTy, Params, false);
+    Function *Chunk =
+        Function::Create(ChunkTy, Function::InternalLinkage, Parent->getName() + ".parfor", TheModule.get());
+    SetFPFunctionAttributes(Chunk);
+    Chunk->addFnAttr(Attribute::NoUnwind);
+
+    // The chunk is a function of its own, so set aside everything codegen
+    // tracks about the current one.
+    auto OuterIP = Builder->saveIP();
+    DebugLoc OuterLoc = Builder->getCurrentDebugLocation();
+    auto OuterValues = std::move(NamedValues);
+    auto OuterScopes = DebugScopes;
+    auto OuterSites = std::move(ProfileSites);
+    Value *OuterCounters = ProfileCounters;
+    CoroutineState OuterCoroutine = Coroutine;
+    NamedValues.clear();
+    ProfileSites.clear();
+    ProfileCounters = nullptr;
+    Coroutine = CoroutineState();
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", Chunk);
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", Chunk);
+    BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "exit", Chunk);
+    Builder->SetInsertPoint(EntryBB);
+    CreateDebugFunction(Chunk, Loc);
+
+    Argument *EnvArg = Chunk->getArg(0);
+    Argument *Begin = Chunk->getArg(1);
+    Argument *End = Chunk->getArg(2);
+    EnvArg->setName("env");
+    Begin->setName("begin");
+    End->setName("end");
+
+    Value *ChunkEnv = Builder->CreateBitCast(EnvArg, EnvTy->getPointerTo());
+    Value *ChunkStart = Builder->CreateLoad(VarTy, Builder->CreateStructGEP(EnvTy, ChunkEnv, 0), "start");
+    Value *ChunkStep = Builder->CreateLoad(VarTy, Builder->CreateStructGEP(EnvTy, ChunkEnv, 1), "step");
+    std::vector<AllocaInst *> Copies;
+    for(unsigned i = 0, e = Captures.size(); i != e; ++i) {
+        Type *Ty = Fields[2 + i];
+        AllocaInst *Copy = CreateEntryBlockAlloca(Chunk, Captures[i].first, Ty);
+        DeclareVariable(Copy, Captures[i].first, Loc);
+        Builder->CreateStore(Builder->CreateLoad(Ty, Builder->CreateStructGEP(EnvTy, ChunkEnv, 2 + i)), Copy);
+        NamedValues[Captures[i].first] = Copy;
+        Copies.push_back(Copy);
+    }
+    AllocaInst *Var = CreateEntryBlockAlloca(Chunk, VarName, VarTy);
+    DeclareVariable(Var, VarName, Loc);
+    NamedValues[VarName] = Var;
+    Copies.push_back(Var);
+    ParforCaptures.insert(Copies.begin(), Copies.end());
+
+    // The runtime never hands out an empty range.
+    Builder->CreateBr(LoopBB);
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Iter = Builder->CreatePHI(Int64Ty, 2, "iter");
+    PHINode *Acc = Builder->CreatePHI(DoubleTy, 2, "acc");
+    Iter->addIncoming(Begin, EntryBB);
+    Acc->addIncoming(GetReductionIdentity(Reduction), EntryBB);
+
+    EmitLocation(Loc);
+    Value *Offset = VarTy->isIntegerTy() ? Builder->CreateMul(Iter, ChunkStep)
+                                         : Builder->CreateFMul(Builder->CreateSIToFP(Iter, DoubleTy), ChunkStep);
+    Value *Cur = VarTy->isIntegerTy() ? Builder->CreateAdd(ChunkStart, Offset) : Builder->CreateFAdd(ChunkStart, Offset);
+    Builder->CreateStore(Cur, Var);
+
+    Value *BodyVal = EmitBody();
+    if(BodyVal) {
+        EmitLocation(Loc);
+        Value *NextAcc = EmitReductionStep(Reduction, Acc, ConvertTo(BodyVal, DoubleTy));
+        Value *Next = Builder->CreateAdd(Iter, Builder->getInt64(1), "nextiter", true, true);
+        Iter->addIncoming(Next, Builder->GetInsertBlock());
+        Acc->addIncoming(NextAcc, Builder->GetInsertBlock());
+        Builder->CreateCondBr(Builder->CreateICmpSLT(Next, End), LoopBB, ExitBB);
+        Builder->SetInsertPoint(ExitBB);
+        Builder->CreateRet(NextAcc);
+        verifyFunction(*Chunk);
+    }
+
+    for(auto *Copy : Copies)
+        ParforCaptures.erase(Copy);
+    NamedValues = std::move(OuterValues);
+    DebugScopes = std::move(OuterScopes);
+    ProfileSites = std::move(OuterSites);
+    ProfileCounters = OuterCounters;
+    Coroutine = OuterCoroutine;
+    Builder->restoreIP(OuterIP);
+    Builder->SetCurrentDebugLocation(OuterLoc);
+    if(!BodyVal) {
+        Chunk->eraseFromParent();
+        return nullptr;
+    }
+
+    FunctionCallee Run = TheModule->getOrInsertFunction("__kaleidoscope_parfor", DoubleTy, ChunkTy->getPointerTo(),
+                                                        Int8PtrTy, Int64Ty, Builder->getInt32Ty());
+    Value *Args[] = {Chunk, Builder->CreateBitCast(Env, Int8PtrTy), NumTrips, Builder->getInt32(Reduction)};
+    return Builder->CreateCall(Run, Args, "parfor");
+}
+
+
+/// EmitReduction - a loop over VarName from StartVal, by StepVal, short of
+/// EndVal, that combines the values of EmitBody with Reduction. Unlike a
+/// for loop it keeps its running result in a register, and it counts
+/// iterations rather than testing a condition, so the vectorizer can take
+/// it apart; with IsParallel the iterations go to the runtime's threads.
+static Value *EmitReduction(const std::string &VarName, Value *StartVal, Value *EndVal, Value *StepVal,
+                            char Reduction, bool IsParallel, SourceLocation Loc, function_ref<Value *()> EmitBody) {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    Type *VarTy = StartVal->getType()->isIntegerTy() && StepVal->getType()->isIntegerTy() ? Int64Ty : DoubleTy;
+    StartVal = ConvertTo(StartVal, VarTy);
+    StepVal = ConvertTo(StepVal, VarTy);
+
+    // A bound behind the start, or a zero or NaN step, runs nothing.
+    Value *Trips = Builder->CreateFDiv(Builder->CreateFSub(ConvertTo(EndVal, DoubleTy), ConvertTo(StartVal, DoubleTy)),
+                                       ConvertTo(StepVal, DoubleTy));
+    Trips = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, Trips, nullptr, "trips");
+    Value *InRange = Builder->CreateAnd(Builder->CreateFCmpOGT(Trips, ConstantFP::get(DoubleTy, 0.0)),
+                                        Builder->CreateFCmpOLT(Trips, ConstantFP::get(DoubleTy, 0x1p63)));
+    Value *NumTrips = Builder->CreateSelect(InRange, Builder->CreateFPToSI(Trips, Int64Ty), Builder->getInt64(0),
+                                            "numtrips");
+
+    if(IsParallel)
+        return EmitParallelFor(VarName, StartVal, StepVal, NumTrips, Reduction, Loc, EmitBody);
+
+    PushDebugScope(Loc);
+    AllocaInst *Var = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    DeclareVariable(Var, VarName, Loc);
+
+    BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "reduce", TheFunction);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterreduce");
+    Builder->CreateCondBr(Builder->CreateICmpSGT(NumTrips, Builder->getInt64(0)), LoopBB, AfterBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Iter = Builder->CreatePHI(Int64Ty, 2, "iter");
+    Iter->addIncoming(Builder->getInt64(0), PreheaderBB);
+    Constant *Identity = GetReductionIdentity(Reduction);
+    PHINode *Acc = Builder->CreatePHI(DoubleTy, 2, "acc");
+    Acc->addIncoming(Identity, PreheaderBB);
+    unsigned Site = AddProfileSite('L');
+    EmitProfileCount(Site, 0);
+
+    EmitLocation(Loc);
+    Value *Offset = VarTy->isIntegerTy() ? Builder->CreateMul(Iter, StepVal)
+                                         : Builder->CreateFMul(Builder->CreateSIToFP(Iter, DoubleTy), StepVal);
+    Value *Cur = VarTy->isIntegerTy() ? Builder->CreateAdd(StartVal, Offset) : Builder->CreateFAdd(StartVal, Offset);
+    Builder->CreateStore(Cur, Var);
+
+    AllocaInst *OldVal = NamedValues[VarName];
+    NamedValues[VarName] = Var;
+    Value *BodyVal = EmitBody();
+    if(OldVal)
+        NamedValues[VarName] = OldVal;
+    else
+        NamedValues.erase(VarName);
+    if(!BodyVal) {
+        PopDebugScope();
+        return nullptr;
+    }
+
+    EmitLocation(Loc);
+    Value *NextAcc = EmitReductionStep(Reduction, Acc, ConvertTo(BodyVal, DoubleTy));
+    Value *Next = Builder->CreateAdd(Iter, Builder->getInt64(1), "nextiter", true, true);
+    BasicBlock *LoopEndBB = Builder->GetInsertBlock();
+    Iter->addIncoming(Next, LoopEndBB);
+    Acc->addIncoming(NextAcc, LoopEndBB);
+
+    BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "reduceexit", TheFunction);
+    ProfileSites[Site].Branch = Builder->CreateCondBr(Builder->CreateICmpSLT(Next, NumTrips), LoopBB, ExitBB);
+    Builder->SetInsertPoint(ExitBB);
+    EmitProfileCount(Site, 1);
+    Builder->CreateBr(AfterBB);
+
+    TheFunction->getBasicBlockList().push_back(AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    PHINode *Result = Builder->CreatePHI(DoubleTy, 2, "reduction");
+    Result->addIncoming(Identity, PreheaderBB);
+    Result->addIncoming(NextAcc, ExitBB);
+    PopDebugScope();
+    return Result;
+}
+
+
+/// IsAssignedIn - whether Name may be stored to (or rebound) inside E. Only
+/// variables that never are can keep the integer type of their initializer.
+static bool IsAssignedIn(ExprAST *E, const std::string &Name) {
+    std::set<std::string> Names;
+    CollectBoundNames(E, Names);
+    return Names.count(Name);
+}
+
+
+// The lowering of each kind of expression, shared by the pointer AST and
+// the flat one in FlatAST.cpp. Children are generated through callbacks, in
+// the order each helper calls them.
+typedef function_ref<Value *()> EmitFn;
+
+
+static Value *EmitVariable(const std::string &Name, SourceLocation Loc) {
+    AllocaInst *V = NamedValues[Name];
+    if(!V)
+        return LogErrorV(Loc, "Unknown variable name");
+
+    EmitLocation(Loc);
+    return Builder->CreateLoad(V->getAllocatedType(), V, Name);
+}
+
+
+static Value *EmitUnary(char Opcode, SourceLocation Loc, EmitFn Operand) {
+    Value *OperandV = Operand();
+    if(!OperandV)
+        return nullptr;
+
+    Function *F = getFunction(std::string("unary") + Opcode);
+    if(!F)
+        return LogErrorV(Loc, "Unknown unary operator");
+
+    EmitLocation(Loc);
+    return EmitCall(F, OperandV, "unop");
+}
+
+
+/// EmitAssignment - store the value of RHS to the variable Name.
+static Value *EmitAssignment(const std::string &Name, SourceLocation Loc, EmitFn RHS) {
+    Value *Val = RHS();
+    if(!Val)
+        return nullptr;
+
+    AllocaInst *Variable = NamedValues[Name];
+    if(!Variable)
+        return LogErrorV(Loc, "Unknown variable name");
+    if(ParforCaptures.count(Variable))
+        return LogErrorV(Loc, "a parfor body cannot assign variables bound outside it");
+
+    EmitLocation(Loc);
+    Val = ConvertTo(Val, Variable->getAllocatedType());
+    Builder->CreateStore(Val, Variable);
+    return Val;
+}
+
+
+/// EmitBinary - a builtin or user-defined binary operator other than '='.
+/// The flags say which operands are integer literals.
+static Value *EmitBinary(char Op, SourceLocation Loc, EmitFn LHS, bool LHSIsIntLiteral, EmitFn RHS,
+                         bool RHSIsIntLiteral) {
+    Value *L = LHS();
+    Value *R = RHS();
+    if(!L || !R)
+        return nullptr;
+    L = AdoptIntLiteral(L, LHSIsIntLiteral, R);
+    R = AdoptIntLiteral(R, RHSIsIntLiteral, L);
+
+    EmitLocation(Loc);
+    if(Value *V = EmitBuiltinBinOp(Op, L, R))
+        return V;
 
     Function *F = getFunction(std::string("binary") + Op);
-    assert(F && "binary operator not found!");
+    if(!F)
+        return LogErrorV(Loc, "Unknown binary operator");
 
     Value *Ops[] = {L, R};
-    return Builder.CreateCall(F, Ops, "binop")
+    return EmitCall(F, Ops, "binop");
 }
 
 
-Value *CallExprAST::codegen() {
+/// EmitCallExpr - a call of Callee, or with IsAwait an await of it, whose
+/// NumArgs arguments Arg generates.
+static Value *EmitCallExpr(const std::string &Callee, bool IsAwait, SourceLocation Loc, unsigned NumArgs,
+                           function_ref<Value *(unsigned)> Arg) {
     Function *CalleeF = getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
+    if(!CalleeF)
+        return LogErrorV(Loc, "Unknown function referenced");
 
-    if(CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
+    if(CalleeF->arg_size() != NumArgs)
+        return LogErrorV(Loc, "Incorrect # arguments passed");
+
+    if(IsAsyncFunction(Callee) && !IsAwait)
+        return LogErrorV(Loc, ("'" + Callee + "' is async; call it with await").c_str());
+    if(!IsAsyncFunction(Callee) && IsAwait)
+        return LogErrorV(Loc, ("'" + Callee + "' is not async; call it without await").c_str());
+    if(IsAwait && !Coroutine.Handle)
+        return LogErrorV(Loc, "await is not allowed in a parfor body");
 
     std::vector<Value *> ArgsV;
-    for(unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
+    for(unsigned i = 0; i != NumArgs; ++i) {
+        ArgsV.push_back(Arg(i));
         if(!ArgsV.back())
             return nullptr;
     }
 
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+    EmitLocation(Loc);
+    if(IsAwait)
+        return EmitAwait(CalleeF, ArgsV, getLLVMType(FunctionProtos[Callee]->getReturnType()));
+    return EmitCall(CalleeF, ArgsV, "calltmp");
 }
 
 
-Value *IfExprAST::codegen() {
-    Value *CondV = Cond->codegen();
+static Value *EmitIf(SourceLocation Loc, EmitFn Cond, EmitFn Then, EmitFn Else) {
+    Value *CondV = Cond();
     if(!CondV)
         return nullptr;
 
-    CondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    EmitLocation(Loc);
+    CondV = EmitCondition(CondV, "ifcond");
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-    BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-    BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-    BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
-    
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-    Builder.SetInsertPoint(ThenBB);
+    unsigned Site = AddProfileSite('I');
+    ProfileSites[Site].Branch = Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
-    Value *ThenV = Then->codegen();
+    Builder->SetInsertPoint(ThenBB);
+    EmitProfileCount(Site, 0);
+
+    Value *ThenV = Then();
     if(!ThenV)
         return nullptr;
 
-    Builder.CreateBr(MergeBB);
-    ThenBB = Builder.GetInsertBlock();
+    Builder->CreateBr(MergeBB);
+    ThenBB = Builder->GetInsertBlock();
 
     TheFunction->getBasicBlockList().push_back(ElseBB);
-    Builder.SetInsertPoint(ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+    EmitProfileCount(Site, 1);
 
-    Value *ElseV = Else->codegen();
-    if (!ElseV)
-    return nullptr;
+    Value *ElseV = Else();
+    if(!ElseV)
+        return nullptr;
+
+    Builder->CreateBr(MergeBB);
+    ElseBB = Builder->GetInsertBlock();
 
-    Builder.CreateBr(MergeBB);
-    ElseBB = Builder.GetInsertBlock();
+    // Both arms are done, so their values can be brought to a common type
+    // just before each arm branches to the merge block.
+    Type *Ty = JoinTypes(ThenV->getType(), ElseV->getType());
+    Builder->SetInsertPoint(ThenBB->getTerminator());
+    ThenV = ConvertTo(ThenV, Ty);
+    Builder->SetInsertPoint(ElseBB->getTerminator());
+    ElseV = ConvertTo(ElseV, Ty);
 
     TheFunction->getBasicBlockList().push_back(MergeBB);
-    Builder.SetInsertPoint(MergeBB);
-    PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *PN = Builder->CreatePHI(Ty, 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
@@ -163,144 +1232,298 @@ Value *IfExprAST::codegen() {
 }
 
 
-Value *ForExprAST::codegen() {
-      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+/// EmitFor - a for loop over VarName, or a reduction when Reduction is set.
+/// Step is null for the default step of 1, and CounterAssigned tells whether
+/// the body may store to the loop variable.
+static Value *EmitFor(const std::string &VarName, SourceLocation Loc, char Reduction, bool IsParallel, EmitFn Start,
+                      EmitFn End, EmitFn Step, bool StepIsIntLiteral, EmitFn Body,
+                      function_ref<bool()> CounterAssigned) {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    Value *StartVal = Start();
+    if(!StartVal)
+        return nullptr;
 
-      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    if(Reduction) {
+        Value *EndVal = End();
+        if(!EndVal)
+            return nullptr;
+        Value *StepVal = Step ? Step() : ConstantInt::get(Type::getInt64Ty(*TheContext), 1);
+        if(!StepVal)
+            return nullptr;
 
-      Value *StartVal = Start->codegen();
-      if (!StartVal)
-          return nullptr;
+        EmitLocation(Loc);
+        return EmitReduction(VarName, StartVal, EndVal, StepVal, Reduction, IsParallel, Loc, Body);
+    }
 
-      Builder.CreateStore(StartVal, Alloca);
+    // Count in i64 when the loop starts on an integer value (a literal is a
+    // double on its own), steps by an integer literal and the body never
+    // assigns the counter.
+    Type *VarTy = Type::getDoubleTy(*TheContext);
+    if(StartVal->getType()->isIntegerTy() && (!Step || StepIsIntLiteral) && !CounterAssigned())
+        VarTy = Type::getInt64Ty(*TheContext);
 
-      BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+    EmitLocation(Loc);
+    PushDebugScope(Loc);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    DeclareVariable(Alloca, VarName, Loc);
+    Builder->CreateStore(ConvertTo(StartVal, VarTy), Alloca);
 
-      Builder.CreateBr(LoopBB);
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
-      Builder.SetInsertPoint(LoopBB);
+    Builder->CreateBr(LoopBB);
 
-      AllocaInst *OldVal = NamedValues[VarName];
-      NamedValues[VarName] = Alloca;
+    Builder->SetInsertPoint(LoopBB);
+    unsigned Site = AddProfileSite('L');
+    EmitProfileCount(Site, 0);
 
-      if (!Body->codegen())
-          return nullptr;
+    AllocaInst *OldVal = NamedValues[VarName];
+    NamedValues[VarName] = Alloca;
+
+    if(!Body())
+        return nullptr;
 
-      Value *StepVal = nullptr;
-      if (Step) {
-          StepVal = Step->codegen();
-          if (!StepVal)
-              return nullptr;
-      } else {
-          StepVal = ConstantFP::get(TheContext, APFloat(1.0));
-      }
+    Value *StepVal = Step ? Step() : ConstantInt::get(Type::getInt64Ty(*TheContext), 1);
+    if(!StepVal)
+        return nullptr;
 
-      Value *EndCond = End->codegen();
-      if (!EndCond)
-          return nullptr;
+    Value *EndCond = End();
+    if(!EndCond)
+        return nullptr;
 
-      Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-      Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-      Builder.CreateStore(NextVar, Alloca);
+    EmitLocation(Loc);
+    Value *CurVar = Builder->CreateLoad(VarTy, Alloca, VarName);
+    Value *NextVar;
+    if(VarTy->isIntegerTy())
+        NextVar = Builder->CreateAdd(CurVar, ConvertTo(StepVal, VarTy), "nextvar");
+    else
+        NextVar = Builder->CreateFAdd(CurVar, ConvertTo(StepVal, VarTy), "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
 
-      EndCond = Builder.CreateFCmpONE(EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+    EndCond = EmitCondition(EndCond, "loopcond");
 
-      BasicBlock *AfterBB = BasicBlock::Create(TheContext, "afterloop", TheFunction);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
 
-      Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+    ProfileSites[Site].Branch = Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
 
-      Builder.SetInsertPoint(AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    EmitProfileCount(Site, 1);
 
-      if (OldVal)
-          NamedValues[VarName] = OldVal;
-      else
-          NamedValues.erase(VarName);
+    if(OldVal)
+        NamedValues[VarName] = OldVal;
+    else
+        NamedValues.erase(VarName);
+    PopDebugScope();
 
-      return Constant::getNullValue(Type::getDoubleTy(TheContext));
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
 
-Value *VarExprAST::codegen() {
+/// EmitVar - bind each of Names to the value Init generates for it, then
+/// generate Body. AssignedLater(i) tells whether the initializers after the
+/// i-th or the body may store to the i-th variable.
+static Value *EmitVar(SourceLocation Loc, ArrayRef<std::string> Names, function_ref<Value *(unsigned)> Init,
+                      function_ref<bool(unsigned)> AssignedLater, EmitFn Body) {
     std::vector<AllocaInst *> OldBindings;
 
-    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    PushDebugScope(Loc);
 
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+    for(unsigned i = 0, e = Names.size(); i != e; ++i) {
+        const std::string &VarName = Names[i];
+        Value *InitVal = Init(i);
+        if(!InitVal)
+            return nullptr;
 
-        Value *InitVal;
-        if (Init) {
-            InitVal = Init->codegen();
-            if (!InitVal)
-                return nullptr;
-        } else { 
-            InitVal = ConstantFP::get(TheContext, APFloat(0.0));
-        }
+        // A variable that is assigned later might receive a double, so only
+        // never-assigned ones keep an integer or bool initializer's type.
+        Type *VarTy = InitVal->getType();
+        if(!VarTy->isDoubleTy() && AssignedLater(i))
+            VarTy = Type::getDoubleTy(*TheContext);
 
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder.CreateStore(InitVal, Alloca);
+        EmitLocation(Loc);
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+        DeclareVariable(Alloca, VarName, Loc);
+        Builder->CreateStore(ConvertTo(InitVal, VarTy), Alloca);
 
         OldBindings.push_back(NamedValues[VarName]);
 
         NamedValues[VarName] = Alloca;
     }
 
-    Value *BodyVal = Body->codegen();
-    if (!BodyVal)
+    Value *BodyVal = Body();
+    if(!BodyVal)
         return nullptr;
 
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    for(unsigned i = 0, e = Names.size(); i != e; ++i)
+        NamedValues[Names[i]] = OldBindings[i];
+    PopDebugScope();
 
     return BodyVal;
 }
 
 
-Function *PrototypeAST::codegen() {
-    std::vector<Value *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
-    FunctionType *FT = FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
-
-    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-
-    unsigned Idx = 0;
-    for(auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
-
-    return F;
-}
-
-
-Function *FunctionAST::codegen() {
+/// EmitFunction - define the function Proto declares, whose body Body
+/// generates, and register Proto as its prototype.
+static Function *EmitFunction(std::unique_ptr<PrototypeAST> Proto, bool IsMemo, SourceLocation BodyLoc, EmitFn Body) {
     auto &P = *Proto;
     FunctionProtos[Proto->getName()] = std::move(Proto);
     Function *TheFunction = getFunction(P.getName());
     if(!TheFunction)
         return nullptr;
 
-    if(P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    SetFPFunctionAttributes(TheFunction);
+    SetInferredAttributes(TheFunction, P);
 
-    BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-    Builder.SetInsertPoint(BB);
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+    Builder->SetInsertPoint(BB);
+    CreateDebugFunction(TheFunction, P.getLoc());
+    Coroutine = CoroutineState();
+    if(P.isAsync())
+        BeginCoroutine(TheFunction);
 
     NamedValues.clear();
     for(auto &Arg : TheFunction->args()) {
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
-        Builder.CreateStore(&Arg, Alloca);
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+        DeclareVariable(Alloca, Arg.getName(), P.getLoc(), Arg.getArgNo() + 1);
+        Builder->CreateStore(&Arg, Alloca);
         NamedValues[std::string(Arg.getName())] = Alloca;
     }
 
-    if(Value *RetVal = Body->codegen()) {
-        Builder.CreateRet(RetVal);
+    ProfileSites.clear();
+    ProfileCounters = nullptr;
+    if(Instrument)
+        EmitProfileEntry(TheFunction);
+
+    Value *RetVal = Body();
+    if(RetVal) {
+        EmitLocation(BodyLoc);
+        if(ProfileCounters)
+            EmitProfileExit();
+        if(Coroutine.Handle)
+            EndCoroutine(RetVal);
+        else
+            Builder->CreateRet(ConvertTo(RetVal, TheFunction->getReturnType()));
+        ApplyProfile(TheFunction);
         verifyFunction(*TheFunction);
-        return TheFunction;
+    } else {
+        TheFunction->eraseFromParent();
+        if(Coroutine.Handle) {
+            delete Coroutine.CleanupBB;
+            delete Coroutine.SuspendBB;
+        }
+        if(P.isBinaryOp())
+            ForgetOperator(P.getOperatorName());
     }
 
-    TheFunction->eraseFromParent();
+    // Code built outside any function must not inherit this one's scope,
+    // counters or coroutine.
+    ProfileCounters = nullptr;
+    Coroutine = CoroutineState();
+    DebugScopes.clear();
+    Builder->SetCurrentDebugLocation(DebugLoc());
+    if(!RetVal)
+        return nullptr;
+    if(P.isAsync() && P.getName() == "__anon_expr")
+        return EmitAsyncRunner(TheFunction);
+    return IsMemo ? EmitMemoWrapper(TheFunction, P) : TheFunction;
+}
 
-    if(P.isBinaryOp())
-        BinopPrecedence.erase(P.getOperatorName());
 
-    return nullptr;
+Value *NumberExprAST::codegen() {
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+
+Value *VariableExprAST::codegen() {
+    return EmitVariable(Name, getLoc());
+}
+
+
+Value *UnaryExprAST::codegen() {
+    return EmitUnary(Opcode, getLoc(), [this] { return Operand->codegen(); });
+}
+
+
+Value *BinaryExprAST::codegen() {
+    if(Op == '=') {
+        const std::string *Name = LHS->getVariableName();
+        if(!Name)
+            return LogErrorV(getLoc(), "destination of '=' must be a variable");
+        return EmitAssignment(*Name, getLoc(), [this] { return RHS->codegen(); });
+    }
+
+    return EmitBinary(Op, getLoc(), [this] { return LHS->codegen(); }, LHS->isIntConstant(),
+                      [this] { return RHS->codegen(); }, RHS->isIntConstant());
+}
+
+
+Value *CallExprAST::codegen() {
+    return EmitCallExpr(Callee, false, getLoc(), Args.size(), [this](unsigned i) { return Args[i]->codegen(); });
+}
+
+
+Value *AwaitExprAST::codegen() {
+    return EmitCallExpr(Callee, true, getLoc(), Args.size(), [this](unsigned i) { return Args[i]->codegen(); });
+}
+
+
+Value *IfExprAST::codegen() {
+    return EmitIf(getLoc(), [this] { return Cond->codegen(); }, [this] { return Then->codegen(); },
+                  [this] { return Else->codegen(); });
+}
+
+
+Value *ForExprAST::codegen() {
+    auto StepFn = [this] { return Step->codegen(); };
+    return EmitFor(VarName, getLoc(), Reduction, IsParallel, [this] { return Start->codegen(); },
+                   [this] { return End->codegen(); }, Step ? EmitFn(StepFn) : EmitFn(),
+                   Step && Step->isIntConstant(), [this] { return Body->codegen(); },
+                   [this] { return IsAssignedIn(Body.get(), VarName); });
+}
+
+
+Value *VarExprAST::codegen() {
+    std::vector<std::string> Names;
+    for(auto &Var : VarNames)
+        Names.push_back(Var.first);
+
+    auto Init = [this](unsigned i) -> Value * {
+        if(ExprAST *E = VarNames[i].second.get())
+            return E->codegen();
+        return ConstantFP::get(*TheContext, APFloat(0.0));
+    };
+    auto AssignedLater = [this](unsigned i) {
+        if(IsAssignedIn(Body.get(), VarNames[i].first))
+            return true;
+        for(unsigned j = i + 1, e = VarNames.size(); j != e; ++j)
+            if(VarNames[j].second && IsAssignedIn(VarNames[j].second.get(), VarNames[i].first))
+                return true;
+        return false;
+    };
+    return EmitVar(getLoc(), Names, Init, AssignedLater, [this] { return Body->codegen(); });
+}
+
+
+Function *PrototypeAST::codegen() {
+    std::vector<Type *> ArgTys;
+    for(unsigned i = 0, e = Args.size(); i != e; ++i)
+        ArgTys.push_back(getLLVMType(getArgType(i)));
+    // An async function returns its future.
+    Type *RetTy = IsAsync ? Type::getInt8PtrTy(*TheContext) : getLLVMType(RetType);
+    FunctionType *FT = FunctionType::get(RetTy, ArgTys, false);
+
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    SetInferredAttributes(F, *this);
+
+    unsigned Idx = 0;
+    for(auto &Arg : F->args())
+        Arg.setName(Args[Idx++]);
+
+    return F;
+}
+
+
+Function *FunctionAST::codegen() {
+    return EmitFunction(std::move(Proto), IsMemo, Body->getLoc(), [this] { return Body->codegen(); });
 }
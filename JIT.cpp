@@ -1,32 +1,224 @@
+static cl::opt<bool> UseJIT("jit", cl::desc("Run the input in a JIT instead of writing an output file"));
+static cl::opt<unsigned> CompileThreads("compile-threads", cl::init(2),
+                                        cl::desc("Optimize and compile JIT'd definitions on N background threads"),
+                                        cl::value_desc("N"));
+static cl::opt<bool> WritePerfMap("perf-map", cl::desc("List JIT'd functions in /tmp/perf-<pid>.map for perf"));
+
+// Declared first so that it outlives TheJIT, whose destructor waits for the
+// compile threads that still use it.
+static std::unique_ptr<orc::JITTargetMachineBuilder> JITTMB;
+static std::unique_ptr<orc::LLJIT> TheJIT;
+
+
+static bool LogJITError(Error Err) {
+    if(!Err)
+        return false;
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    return true;
+}
+
+
+/// OptimizeJITModule - the JIT's IR transform. It runs on whichever compile
+/// thread materializes the module, so it gets a TargetMachine of its own.
+/// Only the main dylib is optimized here: the embedding API's dylibs arrive
+/// already run through the O3 pipeline by CompileFunction.
+static Expected<orc::ThreadSafeModule> OptimizeJITModule(orc::ThreadSafeModule TSM,
+                                                         const orc::MaterializationResponsibility &R) {
+    if(&R.getTargetJITDylib() != &TheJIT->getMainJITDylib())
+        return std::move(TSM);
+
+    auto TM = JITTMB->createTargetMachine();
+    if(!TM)
+        return TM.takeError();
+    TSM.withModuleDo([&](Module &M) { OptimizeModule(M, TM->get()); });
+    return std::move(TSM);
+}
+
+
+/// PerfMapListener - append each function of every JIT'd object to
+/// /tmp/perf-<pid>.map, where perf looks up names for anonymous code. Each
+/// top-level expression gets an entry of its own at its own address.
+class PerfMapListener : public JITEventListener {
+    std::mutex Mutex;
+    std::unique_ptr<raw_fd_ostream> OS;
+
+    public:
+    PerfMapListener() {
+        std::string Filename = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+        std::error_code EC;
+        OS = std::make_unique<raw_fd_ostream>(Filename, EC, sys::fs::OF_Text);
+        if(EC) {
+            errs() << "Could not open " << Filename << ": " << EC.message() << "\n";
+            OS.reset();
+        }
+    }
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        if(!OS)
+            return;
+
+        // The debug copy has its sections moved to where they were loaded.
+        auto DebugObj = L.getObjectForDebug(Obj);
+        const object::ObjectFile &Loaded = DebugObj.getBinary() ? *DebugObj.getBinary() : Obj;
+
+        std::lock_guard<std::mutex> Lock(Mutex);
+        for(auto &Entry : object::computeSymbolSizes(Loaded)) {
+            auto Type = Entry.first.getType();
+            auto Name = Entry.first.getName();
+            auto Addr = Entry.first.getAddress();
+            if(Type && *Type == object::SymbolRef::ST_Function && Name && Addr && Entry.second)
+                *OS << format("%llx %llx ", (unsigned long long)*Addr, (unsigned long long)Entry.second) << *Name
+                    << "\n";
+            if(!Type)
+                consumeError(Type.takeError());
+            if(!Name)
+                consumeError(Name.takeError());
+            if(!Addr)
+                consumeError(Addr.takeError());
+        }
+        OS->flush();
+    }
+};
+
+
+/// CreateObjectLayer - link JIT'd objects in process. With -g every object is
+/// also announced to gdb's JIT interface and, when LLVM was built with perf
+/// support, written to a jitdump file, so both can symbolize JIT'd frames.
+static std::unique_ptr<orc::ObjectLayer> CreateObjectLayer(orc::ExecutionSession &ES, const Triple &TT) {
+    auto Layer = std::make_unique<orc::RTDyldObjectLinkingLayer>(
+        ES, [] { return std::make_unique<SectionMemoryManager>(); });
+    if(EmitDebugInfo) {
+        Layer->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+        if(auto *Perf = JITEventListener::createPerfJITEventListener())
+            Layer->registerJITEventListener(*Perf);
+    }
+    if(WritePerfMap) {
+        static PerfMapListener PerfMap;
+        Layer->registerJITEventListener(PerfMap);
+    }
+    return Layer;
+}
+
+
+/// InitializeJIT - create the JIT. With -compile-threads above zero, modules
+/// are optimized and compiled on a thread pool rather than by the thread
+/// that looks their symbols up.
+static bool InitializeJIT() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+    if(!JTMB)
+        return !LogJITError(JTMB.takeError());
+    JITTMB = std::make_unique<orc::JITTargetMachineBuilder>(std::move(*JTMB));
+
+    auto JIT = orc::LLJITBuilder()
+                   .setJITTargetMachineBuilder(*JITTMB)
+                   .setNumCompileThreads(CompileThreads)
+                   .setObjectLinkingLayerCreator(CreateObjectLayer)
+                   .create();
+    if(!JIT)
+        return !LogJITError(JIT.takeError());
+    TheJIT = std::move(*JIT);
+
+    TheJIT->getIRTransformLayer().setTransform(OptimizeJITModule);
+    TheJIT->getMainJITDylib().addGenerator(cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        TheJIT->getDataLayout().getGlobalPrefix())));
+    return true;
+}
+
+
 static void InitializeModuleAndPassManager() {
-    TheModule = std::make_unique<Module>("my cool jit", TheContext);
+    // A failed compile leaves its module behind, which must go before the
+    // context it lives in.
+    DBuilder.reset();
+    Builder.reset();
+    TheModule.reset();
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+    Builder->setFastMathFlags(GetFastMathFlags());
+    if(TheJIT)
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+    InitializeDebugInfo();
+    SetProfileSummary();
+}
+
+
+/// TakeModule - hand the current module and its context over to the JIT and
+/// start a new pair, so codegen never shares a context with a module that a
+/// compile thread is working on.
+static orc::ThreadSafeModule TakeModule() {
+    FinalizeDebugInfo();
+    orc::ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+    InitializeModuleAndPassManager();
+    return TSM;
+}
+
+
+/// CompileInBackground - ask for Name without waiting for it. The lookup
+/// queues the module defining it on the compile threads and returns at once;
+/// a later call to it blocks only if it is still being compiled.
+static void CompileInBackground(StringRef Name) {
+    auto &ES = TheJIT->getExecutionSession();
+    ES.lookup(orc::LookupKind::Static, orc::makeJITDylibSearchOrder(&TheJIT->getMainJITDylib()),
+              orc::SymbolLookupSet(TheJIT->mangleAndIntern(Name)), orc::SymbolState::Ready,
+              [](Expected<orc::SymbolMap> Result) {
+                  if(!Result)
+                      LogJITError(Result.takeError());
+              },
+              orc::NoDependenciesToRegister);
 }
 
 
 static void HandleDefinition() {
     if(auto FnAST = ParseDefinition()) {
+        FnAST->optimize();
         if(auto *FnIR = FnAST->codegen()) {
             fprintf(stderr, "Read function definition:");
             FnIR->print(errs());
             fprintf(stderr, "\n");
+
+            if(UseJIT) {
+                std::string Name = FnIR->getName().str();
+                if(!LogJITError(TheJIT->addIRModule(TakeModule())))
+                    CompileInBackground(Name);
+            }
         }
     } else {
-        getNextToken();
+        SynchronizeParser();
     }
 }
 
 
 static void HandleTopLevelExpression() {
     if(auto FnAST = ParseTopLevelExpr()) {
-        FnAST->codegen();
+        FnAST->optimize();
+        if(FnAST->codegen() && UseJIT) {
+            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+            if(LogJITError(TheJIT->addIRModule(RT, TakeModule())))
+                return;
+
+            auto ExprSymbol = TheJIT->lookup("__anon_expr");
+            if(!ExprSymbol) {
+                LogJITError(ExprSymbol.takeError());
+                return;
+            }
+
+            double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+            fprintf(stderr, "Evaluated to %f\n", FP());
+            LogJITError(RT->remove());
+        }
     } else {
-        getNextToken();
+        SynchronizeParser();
     }
 }
 
 
 static void MainLoop() {
-    while(true) {
+    while(!ErrorLimitReached()) {
         switch(CurTok) {
             case tok_eof:
                 return;
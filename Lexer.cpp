@@ -2,19 +2,444 @@
 
 extern static std::string IdentifierStr;
 extern double NumVal;
+extern bool NumIsInteger;
+extern const char *NumError;
+
+
+// Lexer input: stdin, unless SetLexerInput pointed it at a buffer.
+static const char *InputBegin = nullptr;
+static const char *InputPtr = nullptr;
+static const char *InputEnd = nullptr;
+static int LastChar = ' ';
+
+// Everything read from stdin so far, so that its tokens have offsets and
+// locations just as a buffer's do.
+static std::string StdinText;
+
+
+static int readChar() {
+    if(InputPtr)
+        return InputPtr == InputEnd ? EOF : (unsigned char)*InputPtr++;
+
+    int C = getchar();
+    if(C != EOF)
+        StdinText += C;
+    return C;
+}
+
+
+/// LastCharOffset - where LastChar is in the input, or its end after EOF.
+static size_t LastCharOffset() {
+    size_t Read = InputPtr ? InputPtr - InputBegin : StdinText.size();
+    return LastChar == EOF ? Read : Read - 1;
+}
+
+
+/// LexedToken - what gettok found besides the token's kind. Only the
+/// thread lexing touches it; the parser sees tokens through a TokenStream.
+struct LexedToken {
+    size_t Offset;         // start of the token in the buffer or StdinText
+    std::string Spelling;  // identifier or number read from stdin
+    double Number;
+    bool IsInteger;
+    const char *NumError;
+};
+static LexedToken Lexed;
+
+
+/// ResetLexer - have gettok lex [Begin, End) from the next token on, or
+/// stdin again when Begin is null.
+static void ResetLexer(const char *Begin, const char *End) {
+    InputBegin = InputPtr = Begin;
+    InputEnd = End;
+    LastChar = ' ';
+    StdinText.clear();
+}
+
+
+// The runs of characters gettok skips over in bulk.
+enum CharRun {
+    run_space,       // isspace
+    run_identifier,  // isalnum
+    run_line         // anything up to '\n' or '\r'
+};
+
+
+static bool InRun(CharRun Run, unsigned char C) {
+    switch(Run) {
+        case run_space:
+            return C == ' ' || (unsigned char)(C - '\t') <= '\r' - '\t';
+        case run_identifier:
+            return (unsigned char)(C - '0') <= 9 || (unsigned char)((C | 0x20) - 'a') <= 'z' - 'a';
+        case run_line:
+            return C != '\n' && C != '\r';
+    }
+    return false;
+}
+
+
+/// ScanRunScalar - the end of the Run starting at P, one byte at a time.
+static const char *ScanRunScalar(const char *P, const char *End, CharRun Run) {
+    while(P != End && InRun(Run, *P))
+        ++P;
+    return P;
+}
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+
+// x86-64 always has SSE2. A byte C lies in [Lo, Lo + N] when the unsigned
+// C - Lo is at most N, that is when min(C - Lo, N) is C - Lo.
+static __m128i InRange128(__m128i V, char Lo, char N) {
+    __m128i D = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(N)), D);
+}
+
+
+/// StopMask128 - a bit for each of the 16 bytes at P that ends Run.
+static unsigned StopMask128(const char *P, CharRun Run) {
+    __m128i V = _mm_loadu_si128((const __m128i *)P);
+    __m128i In;
+    switch(Run) {
+        case run_space:
+            In = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')), InRange128(V, '\t', '\r' - '\t'));
+            break;
+        case run_identifier:
+            In = _mm_or_si128(InRange128(V, '0', 9), InRange128(_mm_or_si128(V, _mm_set1_epi8(0x20)), 'a', 'z' - 'a'));
+            break;
+        case run_line:
+            return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                                                  _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+    }
+    return ~_mm_movemask_epi8(In) & 0xFFFF;
+}
+
+
+static const char *ScanRunSSE2(const char *P, const char *End, CharRun Run) {
+    for(; End - P >= 16; P += 16)
+        if(unsigned Stop = StopMask128(P, Run))
+            return P + countTrailingZeros(Stop);
+    return ScanRunScalar(P, End, Run);
+}
+
+
+#ifdef __GNUC__
+__attribute__((target("avx2"))) static __m256i InRange256(__m256i V, char Lo, char N) {
+    __m256i D = _mm256_sub_epi8(V, _mm256_set1_epi8(Lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(D, _mm256_set1_epi8(N)), D);
+}
+
+
+/// StopMask256 - StopMask128 for the 32 bytes at P.
+__attribute__((target("avx2"))) static uint32_t StopMask256(const char *P, CharRun Run) {
+    __m256i V = _mm256_loadu_si256((const __m256i *)P);
+    __m256i In;
+    switch(Run) {
+        case run_space:
+            In = _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')), InRange256(V, '\t', '\r' - '\t'));
+            break;
+        case run_identifier:
+            In = _mm256_or_si256(InRange256(V, '0', 9),
+                                 InRange256(_mm256_or_si256(V, _mm256_set1_epi8(0x20)), 'a', 'z' - 'a'));
+            break;
+        case run_line:
+            return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                                        _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))));
+    }
+    return ~(uint32_t)_mm256_movemask_epi8(In);
+}
+
+
+__attribute__((target("avx2"))) static const char *ScanRunAVX2(const char *P, const char *End, CharRun Run) {
+    for(; End - P >= 32; P += 32)
+        if(uint32_t Stop = StopMask256(P, Run))
+            return P + countTrailingZeros(Stop);
+    return ScanRunSSE2(P, End, Run);
+}
+#endif
+#endif
+
+
+using ScanRunFn = const char *(*)(const char *, const char *, CharRun);
+
+static const char *ScanRunFirst(const char *P, const char *End, CharRun Run);
+
+/// ScanRun - the end of the Run at P, found with the widest vectors the CPU
+/// has. Only one thread lexes at a time.
+static ScanRunFn ScanRun = ScanRunFirst;
+
+
+/// ScanRunFirst - ScanRun until the first call picks a scanner, which keeps
+/// the CPU check out of static initialization.
+static const char *ScanRunFirst(const char *P, const char *End, CharRun Run) {
+    ScanRun = ScanRunScalar;
+#if defined(__x86_64__) || defined(_M_X64)
+    ScanRun = ScanRunSSE2;
+#ifdef __GNUC__
+    if(__builtin_cpu_supports("avx2"))
+        ScanRun = ScanRunAVX2;
+#endif
+#endif
+    return ScanRun(P, End, Run);
+}
+
+
+/// PowerOfTen - 10^e as a 128-bit mantissa, rounded down, whose top bit is
+/// set. The binary exponent is implied by e.
+struct PowerOfTen {
+    uint64_t Lo, Hi;
+};
+
+static const int MinPowerOfTen = -348;
+static const int MaxPowerOfTen = 347;
+
+
+/// FloorLog2Pow10 - floor(e * log2(10)) for the exponents in the table.
+static int FloorLog2Pow10(int E) {
+    return (217706 * E) >> 16;
+}
+
+
+/// GetPowersOfTen - the table Eisel-Lemire multiplies by, built with APInt
+/// the first time a literal misses the exact fast path.
+static const std::vector<PowerOfTen> &GetPowersOfTen() {
+    static const std::vector<PowerOfTen> Table = [] {
+        std::vector<PowerOfTen> T;
+        const unsigned Bits = 1536;
+        for(int E = MinPowerOfTen; E <= MaxPowerOfTen; ++E) {
+            // Scale 10^E by 2^Shift into [2^127, 2^128).
+            int Shift = 127 - FloorLog2Pow10(E);
+            APInt Pow(Bits, 1);
+            for(int i = 0; i < std::abs(E); ++i)
+                Pow *= 10;
+
+            APInt M(Bits, 0);
+            if(E < 0)
+                M = APInt::getOneBitSet(Bits, Shift).udiv(Pow);
+            else if(Shift >= 0)
+                M = Pow.shl(Shift);
+            else
+                M = Pow.lshr(-Shift);
+            assert(M.getActiveBits() == 128 && "power of ten is not normalized");
+            T.push_back({M.extractBits(64, 0).getZExtValue(), M.extractBits(64, 64).getZExtValue()});
+        }
+        return T;
+    }();
+    return Table;
+}
+
+
+/// Mul64 - the full 128-bit product of A and B.
+static void Mul64(uint64_t A, uint64_t B, uint64_t &Hi, uint64_t &Lo) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 P = (unsigned __int128)A * B;
+    Hi = (uint64_t)(P >> 64);
+    Lo = (uint64_t)P;
+#else
+    uint64_t ALo = (uint32_t)A, AHi = A >> 32, BLo = (uint32_t)B, BHi = B >> 32;
+    uint64_t LoLo = ALo * BLo, HiLo = AHi * BLo, LoHi = ALo * BHi, HiHi = AHi * BHi;
+    uint64_t Mid = (LoLo >> 32) + (uint32_t)HiLo + (uint32_t)LoHi;
+    Lo = (Mid << 32) | (uint32_t)LoLo;
+    Hi = HiHi + (HiLo >> 32) + (LoHi >> 32) + (Mid >> 32);
+#endif
+}
+
+
+/// EiselLemire - W * 10^E correctly rounded, or false in the rare cases the
+/// 128-bit product cannot decide the rounding. W is nonzero.
+static bool EiselLemire(uint64_t W, int E, double &Result) {
+    if(E < MinPowerOfTen || E > MaxPowerOfTen)
+        return false;
+    const PowerOfTen &P = GetPowersOfTen()[E - MinPowerOfTen];
+
+    int Clz = countLeadingZeros(W);
+    W <<= Clz;
+    uint64_t Exp2 = (uint64_t)(FloorLog2Pow10(E) + 64 + 1023) - Clz;
+
+    uint64_t XHi, XLo;
+    Mul64(W, P.Hi, XHi, XLo);
+
+    // Widen to the full 192-bit product when the truncation error could
+    // reach the bits that decide rounding.
+    if((XHi & 0x1FF) == 0x1FF && XLo + W < W) {
+        uint64_t YHi, YLo;
+        Mul64(W, P.Lo, YHi, YLo);
+        uint64_t MergedHi = XHi, MergedLo = XLo + YHi;
+        if(MergedLo < XLo)
+            ++MergedHi;
+        if((MergedHi & 0x1FF) == 0x1FF && MergedLo + 1 == 0 && YLo + W < W)
+            return false;
+        XHi = MergedHi;
+        XLo = MergedLo;
+    }
+
+    uint64_t Msb = XHi >> 63;
+    uint64_t Mantissa = XHi >> (Msb + 9);
+    Exp2 -= 1 ^ Msb;
+
+    // Exactly halfway between two doubles: leave ties to the slow path.
+    if(XLo == 0 && (XHi & 0x1FF) == 0 && (Mantissa & 3) == 1)
+        return false;
+
+    Mantissa += Mantissa & 1;
+    Mantissa >>= 1;
+    if(Mantissa >> 53) {
+        Mantissa >>= 1;
+        ++Exp2;
+    }
+
+    // Subnormals and overflow go to the slow path as well.
+    if(Exp2 - 1 >= 0x7FF - 1)
+        return false;
+
+    uint64_t Bits = Exp2 << 52 | (Mantissa & ((uint64_t(1) << 52) - 1));
+    memcpy(&Result, &Bits, sizeof(Result));
+    return true;
+}
+
+
+/// IsNumberChar - whether C continues a number literal whose previous
+/// character is Prev. Anything alphanumeric is taken in, so that "1.2.3" or
+/// "12ab" are rejected as a whole rather than split into several tokens.
+static bool IsNumberChar(int Prev, int C) {
+    return isalnum(C) || C == '.' || ((C == '+' || C == '-') && (Prev == 'e' || Prev == 'E'));
+}
+
+
+/// ScanNumber - lex the number literal that starts at P and set P past it.
+/// Literals are digits with at most one '.', then an optional exponent. The
+/// first 19 significant digits are gathered into an integer W, so that the
+/// value is W * 10^Exp10 give or take the digits dropped. That is exact
+/// with one multiply or divide when both factors are exact doubles,
+/// otherwise Eisel-Lemire almost always decides it; the few literals left
+/// over go to APFloat. Returns why the literal is malformed, or null.
+static const char *ScanNumber(const char *&P, const char *End, double &Value, bool &IsInteger) {
+    static const double ExactPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *Begin = P;
+    uint64_t W = 0;
+    int NumDigits = 0, Significant = 0, Exp10 = 0;
+    bool Truncated = false, SawDot = false;
+
+    for(; P != End; ++P) {
+        if(*P == '.' && !SawDot) {
+            SawDot = true;
+            continue;
+        }
+        if(!isdigit(*P))
+            break;
+
+        unsigned D = *P - '0';
+        ++NumDigits;
+        if(Significant < 19) {
+            W = W * 10 + D;
+            Significant += W != 0;
+            Exp10 -= SawDot;
+        } else {
+            Truncated |= D != 0;
+            Exp10 += !SawDot;
+        }
+    }
+    IsInteger = !SawDot;
+
+    const char *Error = nullptr;
+    if(!NumDigits)
+        Error = "expected digits in number";
+
+    if(!Error && P != End && (*P == 'e' || *P == 'E')) {
+        IsInteger = false;
+        ++P;
+        bool Negative = P != End && *P == '-';
+        if(P != End && (*P == '+' || *P == '-'))
+            ++P;
+        if(P == End || !isdigit(*P))
+            Error = "expected exponent digits in number";
+
+        int Exponent = 0;
+        for(; P != End && isdigit(*P); ++P)
+            if(Exponent < 100000)
+                Exponent = Exponent * 10 + (*P - '0');
+        Exp10 += Negative ? -Exponent : Exponent;
+    }
+
+    if(P != End && IsNumberChar(P[-1], *P)) {
+        bool ExtraDot = false;
+        for(; P != End && IsNumberChar(P[-1], *P); ++P)
+            ExtraDot |= *P == '.';
+        if(!Error)
+            Error = ExtraDot ? "more than one '.' in number" : "invalid character in number";
+    }
+    if(Error) {
+        Value = 0;
+        return Error;
+    }
+
+    if(W == 0) {
+        Value = 0;
+        return nullptr;
+    }
+
+    if(!Truncated && W <= (uint64_t(1) << 53)) {
+        // 123e25 is 1230000e22, which is still exact.
+        while(Exp10 > 22 && W * 10 <= (uint64_t(1) << 53)) {
+            W *= 10;
+            --Exp10;
+        }
+        if(Exp10 >= 0 && Exp10 <= 22) {
+            Value = (double)W * ExactPowers[Exp10];
+            return nullptr;
+        }
+        if(Exp10 < 0 && Exp10 >= -22) {
+            Value = (double)W / ExactPowers[-Exp10];
+            return nullptr;
+        }
+    }
+
+    // With digits dropped the value lies between W and W + 1; if both round
+    // the same way, so does the literal.
+    double Lower, Upper;
+    if(EiselLemire(W, Exp10, Lower) && (!Truncated || (EiselLemire(W + 1, Exp10, Upper) && Lower == Upper))) {
+        Value = Lower;
+        return nullptr;
+    }
+
+    APFloat F(APFloat::IEEEdouble());
+    auto Status = F.convertFromString(StringRef(Begin, P - Begin), APFloat::rmNearestTiesToEven);
+    if(!Status) {
+        consumeError(Status.takeError());
+        Value = 0;
+        return "invalid number";
+    }
+    Value = F.convertToDouble();
+    return nullptr;
+}
 
 
 static int gettok() {
-    
-    static int LastChar = ' ';
 
+    if(InputPtr && isspace(LastChar)) {
+        InputPtr = ScanRun(InputPtr, InputEnd, run_space);
+        LastChar = readChar();
+    }
     while(isspace(LastChar))
-        LastChar = getchar();
+        LastChar = readChar();
+
+    Lexed.Offset = LastCharOffset();
 
     if(isalpha(LastChar)) {
-        IdentifierStr = LastChar;
-        while(isalnum(LastChar = getchar()))
-            IdentifierStr += LastChar;
+        StringRef IdentifierStr;
+        if(InputPtr) {
+            const char *P = ScanRun(InputPtr, InputEnd, run_identifier);
+            IdentifierStr = StringRef(InputPtr - 1, P - InputPtr + 1);
+            InputPtr = P;
+            LastChar = readChar();
+        } else {
+            Lexed.Spelling = LastChar;
+            while(isalnum(LastChar = readChar()))
+                Lexed.Spelling += LastChar;
+            IdentifierStr = Lexed.Spelling;
+        }
 
         if (IdentifierStr == "def")
           return tok_def;
@@ -40,19 +465,32 @@ static int gettok() {
     }
 
     if(isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while(isdigit(LastChar) || LastChar == '.');
+        if(InputPtr) {
+            // Scan the buffer in place; literals never span lines.
+            const char *P = InputPtr - 1;
+            Lexed.NumError = ScanNumber(P, InputEnd, Lexed.Number, Lexed.IsInteger);
+            InputPtr = P;
+            LastChar = readChar();
+        } else {
+            // stdin has to be read a character at a time.
+            Lexed.Spelling.clear();
+            do {
+                Lexed.Spelling += LastChar;
+                LastChar = readChar();
+            } while(IsNumberChar(Lexed.Spelling.back(), LastChar));
 
-        NumVal = stdtod(NumStr.c_str(), nullptr);
+            const char *P = Lexed.Spelling.data();
+            Lexed.NumError = ScanNumber(P, P + Lexed.Spelling.size(), Lexed.Number, Lexed.IsInteger);
+        }
         return tok_number;
     }
 
     if(LastChar == '#') {
+        if(InputPtr) {
+            InputPtr = ScanRun(InputPtr, InputEnd, run_line);
+        }
         do {
-            LastChar = getchar();
+            LastChar = readChar();
         } while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if(LastChar != EOF)
@@ -63,7 +501,301 @@ static int gettok() {
         return tok_eof;
 
     int ThisChar = LastChar;
-    LastChar = getchar();
+    LastChar = readChar();
     return ThisChar;
 
 }
+
+
+static cl::opt<bool> LexOnThread("lex-thread",
+                                 cl::desc("Tokenize buffered input on a thread of its own, ahead of the parser"));
+
+
+/// TokenBlock - a run of lexed tokens, one array per field, so walking the
+/// kinds touches nothing else. A token's line and column are worked out from
+/// its offset when the parser takes it.
+struct TokenBlock {
+    static const unsigned Capacity = 4096;
+
+    int16_t Kinds[Capacity];
+    uint32_t Offsets[Capacity];  // spelling, in the input or in StdinText
+    uint32_t Lengths[Capacity];
+    double Numbers[Capacity];    // value of a tok_number; NaN if malformed
+};
+
+
+/// TokenStream - the tokens of one input, which the parser walks by index.
+/// A buffer is tokenized up front, on the parser's thread or with -lex-thread
+/// on one of its own, publishing each block as it fills. stdin is lexed on
+/// demand, a token at a time, so the REPL still answers line by line.
+class TokenStream {
+    const char *Input;  // the buffer, or null for stdin
+
+    // Grown by the lexer; what it has published is read under Mutex.
+    std::vector<std::unique_ptr<TokenBlock>> Blocks;
+    size_t NumTokens = 0;
+    bool Done = false;
+    std::mutex Mutex;
+    std::condition_variable Grown;
+    std::thread Lexer;
+    size_t NumLexed = 0;
+
+    // The parser's view, refreshed only when it runs past its end.
+    std::vector<TokenBlock *> Visible;
+    size_t NumVisible = 0;
+    size_t Pos = 0;
+
+    // Where each line starts, as far into the input as the parser has been.
+    std::vector<uint32_t> LineStarts = {0};
+    uint32_t Scanned = 0;
+
+    int lexOne();
+    bool ensure(size_t I);
+    SourceLocation locate(uint32_t Offset);
+
+public:
+    TokenStream(const char *Begin, const char *End, bool OnThread) : Input(Begin) {
+        // Offsets are 32 bits.
+        if(End - Begin > UINT32_MAX) {
+            errs() << "Input is larger than 4 GiB\n";
+            End = Begin;
+        }
+        ResetLexer(Begin, End);
+        if(!Input)
+            return;
+        if(OnThread)
+            Lexer = std::thread([this] {
+                while(lexOne() != tok_eof)
+                    ;
+            });
+        else
+            while(lexOne() != tok_eof)
+                ;
+    }
+
+    ~TokenStream() {
+        if(Lexer.joinable())
+            Lexer.join();
+    }
+
+    int take();
+    int peek(size_t N);
+
+    /// getPosition/seek - mark the next token to take, and go back to it.
+    size_t getPosition() const { return Pos; }
+    void seek(size_t P) { Pos = P; }
+};
+
+
+/// lexOne - append the next token to the stream, publishing it once its
+/// block is full, the input ends, or the parser is waiting on stdin.
+int TokenStream::lexOne() {
+    unsigned i = NumLexed % TokenBlock::Capacity;
+    if(!i) {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Blocks.push_back(std::make_unique<TokenBlock>());
+    }
+    TokenBlock *Block = Blocks[NumLexed / TokenBlock::Capacity].get();
+
+    int Kind = gettok();
+    if(!Input && StdinText.size() > UINT32_MAX) {
+        errs() << "Input is larger than 4 GiB\n";
+        Kind = tok_eof;
+    }
+    Block->Kinds[i] = Kind;
+    Block->Offsets[i] = Lexed.Offset;
+    Block->Lengths[i] = LastCharOffset() - Lexed.Offset;
+    Block->Numbers[i] = 0;
+    if(Kind == tok_number)
+        Block->Numbers[i] = Lexed.NumError ? std::nan("") : Lexed.Number;
+
+    if(++NumLexed % TokenBlock::Capacity == 0 || Kind == tok_eof || !Input) {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        NumTokens = NumLexed;
+        Done = Kind == tok_eof;
+        Grown.notify_all();
+    }
+    return Kind;
+}
+
+
+/// ensure - make token I visible to the parser, waiting for the lexer if need
+/// be. False if the input ends before it.
+bool TokenStream::ensure(size_t I) {
+    if(I < NumVisible)
+        return true;
+
+    if(!Input)
+        while(NumLexed <= I && !Done)
+            lexOne();
+
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Grown.wait(Lock, [&] { return NumTokens > I || Done; });
+    NumVisible = NumTokens;
+    for(size_t b = Visible.size(); b != Blocks.size(); ++b)
+        Visible.push_back(Blocks[b].get());
+    return I < NumVisible;
+}
+
+
+/// take - move on to the next token, setting IdentifierStr, NumVal and the
+/// rest from it. Past the end the stream keeps returning tok_eof.
+int TokenStream::take() {
+    if(!ensure(Pos))
+        Pos = NumVisible - 1;
+
+    TokenBlock *Block = Visible[Pos / TokenBlock::Capacity];
+    unsigned i = Pos++ % TokenBlock::Capacity;
+    int Kind = Block->Kinds[i];
+    CurLoc = locate(Block->Offsets[i]);
+
+    StringRef Spelling((Input ? Input : StdinText.data()) + Block->Offsets[i], Block->Lengths[i]);
+    if(Kind == tok_indentifier) {
+        IdentifierStr.assign(Spelling.begin(), Spelling.end());
+    } else if(Kind == tok_number) {
+        NumVal = Block->Numbers[i];
+        NumIsInteger = Spelling.find_first_of(".eE") == StringRef::npos;
+        NumError = nullptr;
+        if(std::isnan(NumVal)) {
+            // Malformed; scan it again for the message.
+            const char *P = Spelling.begin();
+            NumError = ScanNumber(P, Spelling.end(), NumVal, NumIsInteger);
+        }
+    }
+    return Kind;
+}
+
+
+/// locate - the line and column of the byte at Offset, finding line starts
+/// up to it first. The parser mostly moves forward, so Offset is usually on
+/// the last line found.
+SourceLocation TokenStream::locate(uint32_t Offset) {
+    const char *Text = Input ? Input : StdinText.data();
+    while(Scanned < Offset) {
+        auto *NewLine = (const char *)memchr(Text + Scanned, '\n', Offset - Scanned);
+        if(!NewLine) {
+            Scanned = Offset;
+            break;
+        }
+        Scanned = NewLine - Text + 1;
+        LineStarts.push_back(Scanned);
+    }
+
+    size_t Line = LineStarts.size();
+    if(Offset < LineStarts.back())
+        Line = std::upper_bound(LineStarts.begin(), LineStarts.end(), Offset) - LineStarts.begin();
+    return {int(Line), int(Offset - LineStarts[Line - 1] + 1)};
+}
+
+
+/// peek - the kind of the token N after the next one to take.
+int TokenStream::peek(size_t N) {
+    if(!ensure(Pos + N))
+        return tok_eof;
+    return Visible[(Pos + N) / TokenBlock::Capacity]->Kinds[(Pos + N) % TokenBlock::Capacity];
+}
+
+
+static std::unique_ptr<TokenStream> Tokens = std::make_unique<TokenStream>(nullptr, nullptr, false);
+
+
+/// SetLexerInput - parse [Begin, End) from the next token on, or stdin again
+/// when Begin is null.
+static void SetLexerInput(const char *Begin, const char *End) {
+    Tokens.reset();
+    Tokens = std::make_unique<TokenStream>(Begin, End, LexOnThread);
+}
+
+
+static cl::opt<unsigned> BenchLexer("bench-lexer", cl::init(0),
+                                    cl::desc("Time N passes of the lexer over the input"), cl::value_desc("N"));
+
+
+/// BenchmarkLexer - lex stdin N times from memory with each run scanner and
+/// through a TokenStream, then time its number literals through ScanNumber against a std::string
+/// and strtod. Rates are of the bytes each pass reads.
+static bool BenchmarkLexer() {
+    auto Buffer = MemoryBuffer::getSTDIN();
+    if(!Buffer) {
+        errs() << "Could not read stdin: " << Buffer.getError().message() << "\n";
+        return false;
+    }
+    const char *Begin = (*Buffer)->getBufferStart();
+    const char *End = (*Buffer)->getBufferEnd();
+
+    auto Time = [&](const char *Name, size_t Bytes, size_t Items, const char *Unit, function_ref<double()> Run) {
+        auto Start = std::chrono::steady_clock::now();
+        double Sum = 0;
+        for(unsigned i = 0; i != BenchLexer; ++i)
+            Sum += Run();
+        std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+        double Seconds = Elapsed.count() / BenchLexer;
+        outs() << format("%-20s %8.2f ns/%s %8.3f GB/s  (checksum %g)\n", Name,
+                         Items ? Seconds * 1e9 / Items : 0.0, Unit, Bytes / Seconds / 1e9, Sum);
+    };
+
+    size_t NumTokens = 0, LiteralBytes = 0;
+    std::vector<std::pair<const char *, const char *>> Literals;
+    ResetLexer(Begin, End);
+    for(int Tok = gettok(); Tok != tok_eof; Tok = gettok())
+        ++NumTokens;
+    for(const char *P = Begin; P != End; ++P)
+        if((isdigit(*P) || *P == '.') && (P == Begin || !isalnum(P[-1]))) {
+            const char *LitBegin = P;
+            double Value;
+            bool IsInteger;
+            ScanNumber(P, End, Value, IsInteger);
+            LiteralBytes += P - LitBegin;
+            Literals.push_back({LitBegin, P--});
+        }
+
+    std::vector<std::pair<const char *, ScanRunFn>> Scanners = {{"lexer, scalar", ScanRunScalar}};
+#if defined(__x86_64__) || defined(_M_X64)
+    Scanners.push_back({"lexer, SSE2", ScanRunSSE2});
+#ifdef __GNUC__
+    if(__builtin_cpu_supports("avx2"))
+        Scanners.push_back({"lexer, AVX2", ScanRunAVX2});
+#endif
+#endif
+    ScanRunFn Best = ScanRun;
+    for(auto &Scanner : Scanners) {
+        ScanRun = Scanner.second;
+        Time(Scanner.first, End - Begin, NumTokens, "token", [&] {
+            double Sum = 0;
+            ResetLexer(Begin, End);
+            for(int Tok = gettok(); Tok != tok_eof; Tok = gettok())
+                Sum += Tok == tok_number ? Lexed.Number : 0;
+            return Sum;
+        });
+    }
+    ScanRun = Best;
+
+    for(bool OnThread : {false, true})
+        Time(OnThread ? "token stream, thread" : "token stream", End - Begin, NumTokens, "token", [&] {
+            double Sum = 0;
+            TokenStream Stream(Begin, End, OnThread);
+            for(int Tok = Stream.take(); Tok != tok_eof; Tok = Stream.take())
+                Sum += Tok == tok_number ? NumVal : 0;
+            return Sum;
+        });
+
+    Time("strtod numbers", LiteralBytes, Literals.size(), "number", [&] {
+        double Sum = 0;
+        for(auto &Lit : Literals)
+            Sum += strtod(std::string(Lit.first, Lit.second).c_str(), nullptr);
+        return Sum;
+    });
+    Time("scanned numbers", LiteralBytes, Literals.size(), "number", [&] {
+        double Sum = 0;
+        for(auto &Lit : Literals) {
+            const char *P = Lit.first;
+            double Value;
+            bool IsInteger;
+            ScanNumber(P, Lit.second, Value, IsInteger);
+            Sum += Value;
+        }
+        return Sum;
+    });
+    SetLexerInput(nullptr, nullptr);
+    return true;
+}
@@ -24,11 +24,24 @@ enum Token {
     // var_definition
     tok_var = -13
 
+    // memo, parfor, async and await are identifiers that the parser treats
+    // as keywords only where one is expected; see AtContextualKeyword.
+
+};
+
+
+struct SourceLocation {
+    int Line;
+    int Col;
 };
 
 
 static std::string IdentifierStr;
 static double NumVal;
+static bool NumIsInteger;
+static const char *NumError;    // why the last tok_number is malformed, or null
+static SourceLocation CurLoc;    // where the parser's current token starts
 
 
 static int gettok();
+static void SetLexerInput(const char *Begin, const char *End);
@@ -15,3 +15,394 @@ extern "C" DLLEXPORT double printd(double X) {
   fprintf(stderr, "%f\n", X);
   return 0;
 }
+
+/// ProfileEntry - the counters of one function built with -instrument: calls,
+/// cycles spent in it (callees included), then two for each of its Sites,
+/// an if ('I') or a for loop ('L'): then/else entries, or trips/exits.
+struct ProfileEntry {
+  std::string Name;
+  std::string Sites;
+  std::vector<uint64_t> Counters;
+};
+
+static std::mutex ProfileMutex;
+static std::vector<std::unique_ptr<ProfileEntry>> ProfileEntries;
+
+/// PrintProfileReport - list instrumented functions by time spent.
+/// Times include callees, so percentages are of the costliest entry, which
+/// is usually a top-level expression.
+static void PrintProfileReport() {
+  std::vector<ProfileEntry *> Sorted;
+  uint64_t Total = 0;
+  for (auto &E : ProfileEntries) {
+    Sorted.push_back(E.get());
+    Total = std::max(Total, E->Counters[1]);
+  }
+  std::stable_sort(Sorted.begin(), Sorted.end(), [](ProfileEntry *A, ProfileEntry *B) {
+    return A->Counters[1] > B->Counters[1];
+  });
+
+  fprintf(stderr, "%14s %7s %12s %12s  %s\n", "cycles", "%", "calls", "cycles/call", "function");
+  for (auto *E : Sorted) {
+    uint64_t Calls = E->Counters[0], Cycles = E->Counters[1];
+    fprintf(stderr, "%14llu %6.2f%% %12llu %12.1f  %s\n", (unsigned long long)Cycles,
+            Total ? 100.0 * Cycles / Total : 0.0, (unsigned long long)Calls,
+            Calls ? (double)Cycles / Calls : 0.0, E->Name.c_str());
+    for (size_t i = 0; i < E->Sites.size(); ++i) {
+      unsigned long long First = E->Counters[2 + 2 * i], Second = E->Counters[3 + 2 * i];
+      if (E->Sites[i] == 'L')
+        fprintf(stderr, "%36s    loop %zu: %llu trips in %llu runs\n", "", i + 1, First, Second);
+      else
+        fprintf(stderr, "%36s    if %zu: %llu then, %llu else\n", "", i + 1, First, Second);
+    }
+  }
+}
+
+/// WriteProfile - save the counters for -profile-use, to $KALEIDOSCOPE_PROFILE
+/// or default.kprof.
+static void WriteProfile() {
+  const char *Path = getenv("KALEIDOSCOPE_PROFILE");
+  if (!Path)
+    Path = "default.kprof";
+  FILE *F = fopen(Path, "w");
+  if (!F) {
+    fprintf(stderr, "Could not write profile %s\n", Path);
+    return;
+  }
+
+  fprintf(F, "# kaleidoscope profile: name sites calls cycles counters...\n");
+  for (auto &E : ProfileEntries) {
+    fprintf(F, "%s %s", E->Name.c_str(), E->Sites.empty() ? "-" : E->Sites.c_str());
+    for (uint64_t C : E->Counters)
+      fprintf(F, " %llu", (unsigned long long)C);
+    fprintf(F, "\n");
+  }
+  fclose(F);
+}
+
+static void FinishProfile() {
+  std::lock_guard<std::mutex> Lock(ProfileMutex);
+  PrintProfileReport();
+  WriteProfile();
+}
+
+/// __kaleidoscope_profile_counters - storage for the counters of Name, whose
+/// ifs and loops are Sites. Instrumented code calls this on its first entry
+/// and caches the result. The counters outlive the code, so JIT'd
+/// expressions that are freed after running still show up in the report,
+/// and repeated definitions of the same shape share one entry.
+extern "C" DLLEXPORT uint64_t *__kaleidoscope_profile_counters(const char *Name, const char *Sites) {
+  std::lock_guard<std::mutex> Lock(ProfileMutex);
+  if (ProfileEntries.empty())
+    atexit(FinishProfile);
+
+  for (auto &E : ProfileEntries)
+    if (E->Name == Name && E->Sites == Sites)
+      return E->Counters.data();
+
+  ProfileEntries.push_back(std::make_unique<ProfileEntry>());
+  ProfileEntries.back()->Name = Name;
+  ProfileEntries.back()->Sites = Sites;
+  ProfileEntries.back()->Counters.assign(2 + 2 * strlen(Sites), 0);
+  return ProfileEntries.back()->Counters.data();
+}
+
+/// ParforChunk - a parfor body compiled to sum iterations [Begin, End).
+typedef double (*ParforChunk)(void *Env, int64_t Begin, int64_t End);
+
+/// ParforJob - one call of __kaleidoscope_parfor. Its iterations are cut
+/// into leaves of Grain and each leaf's result gets a slot of its own, so
+/// the combined result does not depend on which threads ran which leaves.
+struct ParforJob {
+  ParforChunk Chunk;
+  void *Env;
+  int64_t Grain;
+  std::vector<double> Results;
+  std::atomic<int64_t> Pending;
+};
+
+/// ParforRange - iterations [Begin, End) of Job. Begin is always on a leaf
+/// boundary.
+struct ParforRange {
+  ParforJob *Job;
+  int64_t Begin, End;
+};
+
+/// WorkQueue - the ranges one thread has split off. Its owner pushes and
+/// pops at the back, working depth first; idle threads steal from the
+/// front, where the largest ranges are.
+struct WorkQueue {
+  std::mutex Mutex;
+  std::deque<ParforRange> Ranges;
+};
+
+/// The queue of the calling thread: a worker's own, or queue 0, which
+/// threads outside the pool share.
+static thread_local unsigned CurrentQueue = 0;
+
+/// ParforPool - work-stealing threads for parfor. A thread waiting for its
+/// parfor to finish runs ranges too, so nested parfors cannot deadlock.
+class ParforPool {
+  std::vector<std::unique_ptr<WorkQueue>> Queues;
+  std::vector<std::thread> Workers;
+  std::atomic<int64_t> Queued{0};
+  std::mutex SleepMutex;
+  std::condition_variable Wake;
+  bool Stopping = false;
+
+  bool take(ParforRange &R) {
+    unsigned N = Queues.size();
+    for (unsigned i = 0; i != N; ++i) {
+      WorkQueue &Q = *Queues[(CurrentQueue + i) % N];
+      std::lock_guard<std::mutex> Lock(Q.Mutex);
+      if (Q.Ranges.empty())
+        continue;
+      if (i == 0) {
+        R = Q.Ranges.back();
+        Q.Ranges.pop_back();
+      } else {
+        R = Q.Ranges.front();
+        Q.Ranges.pop_front();
+      }
+      --Queued;
+      return true;
+    }
+    return false;
+  }
+
+  void work(unsigned Index) {
+    CurrentQueue = Index;
+    while (true) {
+      if (runOne())
+        continue;
+      std::unique_lock<std::mutex> Lock(SleepMutex);
+      Wake.wait(Lock, [this] { return Stopping || Queued > 0; });
+      if (Stopping)
+        return;
+    }
+  }
+
+public:
+  explicit ParforPool(unsigned NumWorkers) {
+    for (unsigned i = 0; i <= NumWorkers; ++i)
+      Queues.push_back(std::make_unique<WorkQueue>());
+    for (unsigned i = 1; i <= NumWorkers; ++i)
+      Workers.emplace_back([this, i] { work(i); });
+  }
+
+  ~ParforPool() {
+    {
+      std::lock_guard<std::mutex> Lock(SleepMutex);
+      Stopping = true;
+    }
+    Wake.notify_all();
+    for (auto &T : Workers)
+      T.join();
+  }
+
+  unsigned size() const { return Workers.size(); }
+
+  void push(ParforRange R) {
+    {
+      WorkQueue &Q = *Queues[CurrentQueue];
+      std::lock_guard<std::mutex> Lock(Q.Mutex);
+      Q.Ranges.push_back(R);
+      ++Queued;
+    }
+    // Taking the lock orders this with a worker about to sleep.
+    { std::lock_guard<std::mutex> Lock(SleepMutex); }
+    Wake.notify_one();
+  }
+
+  /// run - split R in halves, queueing the upper ones, down to one leaf and
+  /// run that.
+  void run(ParforRange R) {
+    ParforJob &Job = *R.Job;
+    while (R.End - R.Begin > Job.Grain) {
+      int64_t Leaves = (R.End - R.Begin + Job.Grain - 1) / Job.Grain;
+      int64_t Mid = R.Begin + Leaves / 2 * Job.Grain;
+      push({R.Job, Mid, R.End});
+      R.End = Mid;
+    }
+    Job.Results[R.Begin / Job.Grain] = Job.Chunk(Job.Env, R.Begin, R.End);
+    Job.Pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  /// runOne - run a range from this thread's queue, or stolen from another.
+  bool runOne() {
+    ParforRange R;
+    if (!take(R))
+      return false;
+    run(R);
+    return true;
+  }
+};
+
+/// GetParforPool - the pool, started on the first parfor with
+/// $KALEIDOSCOPE_THREADS threads, the caller included, or one per core.
+static ParforPool &GetParforPool() {
+  static ParforPool Pool([] {
+    unsigned Threads = std::thread::hardware_concurrency();
+    if (const char *Env = getenv("KALEIDOSCOPE_THREADS"))
+      Threads = atoi(Env);
+    return Threads > 1 ? Threads - 1 : 0;
+  }());
+  return Pool;
+}
+
+/// CombineReduction - A and B combined by the reduction operator Op of a
+/// parfor: '+', '*', '<' for min or '>' for max.
+static double CombineReduction(int Op, double A, double B) {
+  switch (Op) {
+  case '*':
+    return A * B;
+  case '<':
+    return std::fmin(A, B);
+  case '>':
+    return std::fmax(A, B);
+  default:
+    return A + B;
+  }
+}
+
+/// __kaleidoscope_parfor - run Chunk over iterations [0, N) of a parfor on
+/// the thread pool and return the results of its ranges combined by Op.
+/// Ranges are a few times smaller than an even share per thread, which
+/// leaves room to balance uneven iterations by stealing.
+extern "C" DLLEXPORT double __kaleidoscope_parfor(ParforChunk Chunk, void *Env, int64_t N, int Op) {
+  if (N <= 0)
+    return Op == '*' ? 1 : Op == '<' ? HUGE_VAL : Op == '>' ? -HUGE_VAL : 0;
+  ParforPool &Pool = GetParforPool();
+  if (!Pool.size() || N == 1)
+    return Chunk(Env, 0, N);
+
+  ParforJob Job;
+  Job.Chunk = Chunk;
+  Job.Env = Env;
+  Job.Grain = std::max<int64_t>(1, N / (8 * (Pool.size() + 1)));
+  int64_t Leaves = (N + Job.Grain - 1) / Job.Grain;
+  Job.Results.assign(Leaves, 0);
+  Job.Pending = Leaves;
+
+  Pool.run({&Job, 0, N});
+  while (Job.Pending.load(std::memory_order_acquire))
+    if (!Pool.runOne())
+      std::this_thread::yield();
+
+  double Result = Job.Results[0];
+  for (int64_t i = 1; i != Leaves; ++i)
+    Result = CombineReduction(Op, Result, Job.Results[i]);
+  return Result;
+}
+
+/// KaleidoscopeFuture - a double that is only available later. An async
+/// function returns one; async host functions make theirs with
+/// __kaleidoscope_future_new and resolve it, from any thread, once the value
+/// is in. Whoever awaits it takes the value and frees it.
+struct EventLoop;
+struct KaleidoscopeFuture {
+  bool Ready = false;
+  double Value = 0;
+  void *Waiter = nullptr;
+  EventLoop *Loop = nullptr;
+};
+
+/// EventLoop - the coroutines of one thread that are ready to resume, and
+/// the timers of the futures delay() hands out.
+struct EventLoop {
+  std::condition_variable Wake;
+  std::deque<void *> Ready;
+  std::multimap<std::chrono::steady_clock::time_point, std::pair<KaleidoscopeFuture *, double>> Timers;
+};
+
+static std::mutex AsyncMutex;
+static thread_local EventLoop CurrentLoop;
+
+/// ResolveLocked - make F ready and queue the coroutine waiting on it, if
+/// any. AsyncMutex must be held.
+static void ResolveLocked(KaleidoscopeFuture *F, double Value) {
+  F->Value = Value;
+  F->Ready = true;
+  if (F->Waiter) {
+    F->Loop->Ready.push_back(F->Waiter);
+    F->Waiter = nullptr;
+  }
+  if (F->Loop)
+    F->Loop->Wake.notify_one();
+}
+
+/// ResumeCoroutine - continue the coroutine whose frame is Handle. LLVM's
+/// coroutine frames begin with their resume function, as C++20's do.
+static void ResumeCoroutine(void *Handle) {
+  (*reinterpret_cast<void (**)(void *)>(Handle))(Handle);
+}
+
+extern "C" DLLEXPORT KaleidoscopeFuture *__kaleidoscope_future_new() {
+  return new KaleidoscopeFuture;
+}
+
+extern "C" DLLEXPORT void __kaleidoscope_future_resolve(KaleidoscopeFuture *F, double Value) {
+  std::lock_guard<std::mutex> Lock(AsyncMutex);
+  ResolveLocked(F, Value);
+}
+
+/// __kaleidoscope_future_await - nonzero if the coroutine Handle must
+/// suspend until F is ready, in which case this thread's loop resumes it.
+extern "C" DLLEXPORT int __kaleidoscope_future_await(KaleidoscopeFuture *F, void *Handle) {
+  std::lock_guard<std::mutex> Lock(AsyncMutex);
+  if (F->Ready)
+    return 0;
+  F->Waiter = Handle;
+  F->Loop = &CurrentLoop;
+  return 1;
+}
+
+extern "C" DLLEXPORT double __kaleidoscope_future_take(KaleidoscopeFuture *F) {
+  double Value = F->Value;
+  delete F;
+  return Value;
+}
+
+/// __kaleidoscope_run - run this thread's event loop until F is ready, then
+/// take its value. Every async evaluation started on the thread makes
+/// progress meanwhile, so a host multiplexes many of them on one thread by
+/// starting them all and then running each one's future.
+extern "C" DLLEXPORT double __kaleidoscope_run(KaleidoscopeFuture *F) {
+  EventLoop &Loop = CurrentLoop;
+  std::unique_lock<std::mutex> Lock(AsyncMutex);
+  F->Loop = &Loop;
+  while (!F->Ready) {
+    if (!Loop.Ready.empty()) {
+      void *Handle = Loop.Ready.front();
+      Loop.Ready.pop_front();
+      Lock.unlock();
+      ResumeCoroutine(Handle);
+      Lock.lock();
+      continue;
+    }
+
+    auto Now = std::chrono::steady_clock::now();
+    if (!Loop.Timers.empty() && Loop.Timers.begin()->first <= Now) {
+      auto First = Loop.Timers.begin();
+      ResolveLocked(First->second.first, First->second.second);
+      Loop.Timers.erase(First);
+    } else if (Loop.Timers.empty()) {
+      Loop.Wake.wait(Lock);
+    } else {
+      Loop.Wake.wait_until(Lock, Loop.Timers.begin()->first);
+    }
+  }
+  Lock.unlock();
+  return __kaleidoscope_future_take(F);
+}
+
+/// delay - an async host function: a future that this thread's loop
+/// resolves to Seconds once they have passed.
+extern "C" DLLEXPORT KaleidoscopeFuture *delay(double Seconds) {
+  auto *F = new KaleidoscopeFuture;
+  auto When = std::chrono::steady_clock::now() + std::chrono::duration<double>(Seconds);
+  std::lock_guard<std::mutex> Lock(AsyncMutex);
+  CurrentLoop.Timers.emplace(std::chrono::time_point_cast<std::chrono::steady_clock::duration>(When),
+                             std::make_pair(F, Seconds));
+  return F;
+}
@@ -0,0 +1,274 @@
+enum OutputKind {
+    out_obj,
+    out_asm,
+    out_bc,
+    out_ll
+};
+
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"));
+static cl::opt<bool> EmitObject("c", cl::desc("Emit an object file without linking (default)"));
+static cl::opt<bool> EmitAssembly("S", cl::desc("Emit assembly, or textual IR with -emit-llvm"));
+static cl::opt<bool> EmitLLVM("emit-llvm", cl::desc("Emit LLVM bitcode, or textual IR with -S"));
+static cl::opt<bool> EmitLTO("flto", cl::desc("Emit bitcode prepared for link-time optimization"));
+static cl::opt<bool> EmitPIC("fPIC", cl::desc("Generate position-independent code"));
+static cl::opt<bool> EmitShared("shared", cl::desc("Link the output into a shared library"));
+static cl::opt<unsigned> CodegenThreads("j", cl::Prefix, cl::init(1),
+                                        cl::desc("Split the module and emit the object file on N threads"),
+                                        cl::value_desc("N"));
+static cl::list<OutputKind> OutputKinds(
+    "output-kinds", cl::CommaSeparated, cl::desc("Write several outputs at once, named after -o"),
+    cl::values(clEnumValN(out_obj, "obj", "Object file (.o)"),
+               clEnumValN(out_asm, "asm", "Assembly (.s)"),
+               clEnumValN(out_bc, "bc", "LLVM bitcode (.bc)"),
+               clEnumValN(out_ll, "ll", "Textual LLVM IR (.ll)")));
+
+
+static std::vector<OutputKind> GetOutputKinds() {
+    std::vector<OutputKind> Kinds(OutputKinds.begin(), OutputKinds.end());
+    if(Kinds.empty()) {
+        if(EmitLLVM || EmitLTO)
+            Kinds.push_back(EmitAssembly ? out_ll : out_bc);
+        else
+            Kinds.push_back(EmitAssembly ? out_asm : out_obj);
+    }
+
+    // IR goes first: running the backend rewrites the module.
+    std::stable_sort(Kinds.begin(), Kinds.end(), [](OutputKind A, OutputKind B) {
+        return (A == out_bc || A == out_ll) && !(B == out_bc || B == out_ll);
+    });
+    return Kinds;
+}
+
+
+/// CheckOutputOptions - reject output flags that cannot all be honoured,
+/// rather than dropping some of them.
+static bool CheckOutputOptions() {
+    if(EmitObject && (EmitAssembly || EmitLLVM || EmitLTO || EmitShared || !OutputKinds.empty())) {
+        errs() << "-c cannot be combined with -S, -emit-llvm, -flto, -shared or -output-kinds\n";
+        return false;
+    }
+
+    auto Kinds = GetOutputKinds();
+    if(EmitShared && std::find(Kinds.begin(), Kinds.end(), out_obj) == Kinds.end()) {
+        errs() << "-shared links an object file, which -S, -emit-llvm and -flto do not produce\n";
+        return false;
+    }
+    return true;
+}
+
+
+static Optional<Reloc::Model> GetRelocModel() {
+    if(EmitPIC || EmitShared)
+        return Reloc::PIC_;
+    return None;
+}
+
+
+static std::unique_ptr<TargetMachine> CreateTargetMachine(const std::string &TargetTriple, std::string &Error) {
+    auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if(!Target)
+        return nullptr;
+
+    auto CPU = "generic";
+    auto Features = "";
+
+    TargetOptions opt;
+    opt.AllowFPOpFusion = GetFPOpFusionMode();
+    opt.UnsafeFPMath = EnableFastMath;
+    opt.NoInfsFPMath = EnableFastMath;
+    opt.NoNaNsFPMath = EnableFastMath;
+    opt.NoSignedZerosFPMath = EnableFastMath;
+    auto RM = GetRelocModel();
+    return std::unique_ptr<TargetMachine>(
+        Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM));
+}
+
+
+/// GetOutputFilename - -o names the output when there is only one; with
+/// several, each takes -o (or "output") with its own extension.
+static std::string GetOutputFilename(OutputKind Kind, bool Single) {
+    if(Single && !OutputFilename.empty() && !EmitShared)
+        return OutputFilename;
+
+    SmallString<128> Path(OutputFilename.empty() ? "output" : OutputFilename.getValue());
+    switch(Kind) {
+        case out_obj:
+            sys::path::replace_extension(Path, "o");
+            break;
+        case out_asm:
+            sys::path::replace_extension(Path, "s");
+            break;
+        case out_bc:
+            sys::path::replace_extension(Path, "bc");
+            break;
+        case out_ll:
+            sys::path::replace_extension(Path, "ll");
+            break;
+    }
+    return std::string(Path.str());
+}
+
+
+static bool EmitFile(Module &M, TargetMachine *TM, OutputKind Kind, StringRef Filename) {
+    std::error_code EC;
+    bool IsText = Kind == out_asm || Kind == out_ll;
+    raw_fd_ostream dest(Filename, EC, IsText ? sys::fs::OF_Text : sys::fs::OF_None);
+
+    if(EC) {
+        errs() << "Could not open file: " << EC.message();
+        return false;
+    }
+
+    if(Kind == out_bc) {
+        WriteBitcodeToFile(M, dest);
+    } else if(Kind == out_ll) {
+        M.print(dest, nullptr);
+    } else {
+        legacy::PassManager pass;
+        auto FileType = Kind == out_asm ? CGFT_AssemblyFile : CGFT_ObjectFile;
+
+        if(TM->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
+            errs() << "TheTargetMachine can't emit a file of this type";
+            return false;
+        }
+
+        pass.run(M);
+    }
+
+    dest.flush();
+    return true;
+}
+
+
+/// RunTool - run the program Name, found on PATH, with Args after argv[0].
+/// What names the job in the errors, which cover a missing program, one
+/// that could not be started and one that failed.
+static bool RunTool(StringRef Name, ArrayRef<StringRef> Args, const Twine &What) {
+    auto Program = sys::findProgramByName(Name);
+    if(!Program) {
+        errs() << "Could not find '" << Name << "' to " << What << "\n";
+        return false;
+    }
+
+    std::vector<StringRef> Argv = {*Program};
+    Argv.insert(Argv.end(), Args.begin(), Args.end());
+    std::string ErrMsg;
+    bool ExecutionFailed = false;
+    int Status = sys::ExecuteAndWait(*Program, Argv, None, {}, 0, 0, &ErrMsg, &ExecutionFailed);
+    if(ExecutionFailed) {
+        errs() << "Could not run " << *Program << " to " << What << ": " << ErrMsg << "\n";
+        return false;
+    }
+    if(Status != 0) {
+        errs() << "Could not " << What << ": " << Name << " "
+               << (Status < 0 ? "crashed: " + ErrMsg : "exited with status " + std::to_string(Status)) << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+static bool LinkRelocatable(ArrayRef<std::string> Objects, StringRef Output) {
+    std::vector<StringRef> Args = {"-r", "-o", Output};
+    Args.insert(Args.end(), Objects.begin(), Objects.end());
+    return RunTool("ld", Args, "combine the object partitions into " + Output);
+}
+
+
+/// EmitObjectParallel - split M into -j partitions, run instruction selection
+/// and emission for each on its own thread and TargetMachine, then merge the
+/// partition objects into one relocatable object.
+static bool EmitObjectParallel(Module &M, StringRef Filename) {
+    std::vector<std::string> Parts;
+    std::vector<std::unique_ptr<raw_fd_ostream>> Streams;
+    std::vector<raw_pwrite_stream *> OSs;
+    for(unsigned i = 0; i != CodegenThreads; ++i) {
+        SmallString<128> Path;
+        if(auto EC = sys::fs::createTemporaryFile("kaleidoscope-part", "o", Path)) {
+            errs() << "Could not create temporary file: " << EC.message();
+            return false;
+        }
+
+        std::error_code EC;
+        Streams.push_back(std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_None));
+        if(EC) {
+            errs() << "Could not open file: " << EC.message();
+            return false;
+        }
+        Parts.push_back(std::string(Path.str()));
+        OSs.push_back(Streams.back().get());
+    }
+
+    // The split moves M's definitions into the partitions, so it works on a
+    // clone that must outlive it.
+    std::string TargetTriple = M.getTargetTriple();
+    auto Clone = CloneModule(M);
+    splitCodeGen(*Clone, OSs, {}, [&]() {
+        std::string Error;
+        return CreateTargetMachine(TargetTriple, Error);
+    });
+
+    for(auto &OS : Streams)
+        OS->close();
+
+    bool OK = LinkRelocatable(Parts, Filename);
+    for(auto &Part : Parts)
+        sys::fs::remove(Part);
+    return OK;
+}
+
+
+static bool LinkSharedLibrary(StringRef Object, StringRef Output) {
+    StringRef Args[] = {"-shared", "-o", Output, Object};
+    return RunTool("cc", Args, "link " + Output);
+}
+
+
+/// EmitOutputs - write every requested output for M. Each backend run but
+/// the last works on a clone, since codegen leaves the IR modified.
+static bool EmitOutputs(Module &M, TargetMachine *TM) {
+    if(EmitPIC || EmitShared)
+        M.setPICLevel(PICLevel::BigPIC);
+
+    auto Kinds = GetOutputKinds();
+    for(unsigned i = 0, e = Kinds.size(); i != e; ++i) {
+        std::string Filename = GetOutputFilename(Kinds[i], e == 1);
+        bool Last = i + 1 == e;
+
+        if(CodegenThreads > 1 && Kinds[i] == out_obj && !EmitShared) {
+            if(!EmitObjectParallel(M, Filename))
+                return false;
+            outs() << "Wrote " << Filename << "\n";
+            continue;
+        }
+
+        std::unique_ptr<Module> Clone;
+        Module *Target = &M;
+        if(!Last && (Kinds[i] == out_obj || Kinds[i] == out_asm)) {
+            Clone = CloneModule(M);
+            Target = Clone.get();
+        }
+
+        if(EmitShared && Kinds[i] == out_obj) {
+            SmallString<128> ObjPath;
+            if(auto EC = sys::fs::createTemporaryFile("kaleidoscope", "o", ObjPath)) {
+                errs() << "Could not create temporary file: " << EC.message();
+                return false;
+            }
+
+            std::string LibName = OutputFilename.empty() ? "output.so" : OutputFilename.getValue();
+            bool OK = EmitFile(*Target, TM, out_obj, ObjPath) && LinkSharedLibrary(ObjPath, LibName);
+            sys::fs::remove(ObjPath);
+            if(!OK)
+                return false;
+            outs() << "Wrote " << LibName << "\n";
+            continue;
+        }
+
+        if(!EmitFile(*Target, TM, Kinds[i], Filename))
+            return false;
+        outs() << "Wrote " << Filename << "\n";
+    }
+    return true;
+}
@@ -1,16 +1,68 @@
 static int CurTok;
 static int getNextToken() {
-    return CurTok = gettok();
+    return CurTok = Tokens->take();
+}
+
+
+/// PeekToken - the kind of the token N after CurTok, leaving CurTok alone.
+static int PeekToken(unsigned N = 1) {
+    return Tokens->peek(N - 1);
+}
+
+
+/// AtContextualKeyword - whether CurTok is Word used as a keyword. memo,
+/// parfor, async and await stay identifiers unless a name follows them, so
+/// "def memo fib(n)" is a memo function but "def memo(n)" is named memo.
+static bool AtContextualKeyword(const char *Word) {
+    if(CurTok != tok_indentifier || IdentifierStr != Word)
+        return false;
+    int Next = PeekToken();
+    return Next == tok_indentifier || Next == tok_binary || Next == tok_unary;
 }
 
 
 static std::map<char, int> BinopPrecedence;
 
 
+/// InstallBuiltinOperators - reset the precedence table to the builtin
+/// binary operators, dropping any that definitions added.
+static void InstallBuiltinOperators() {
+    BinopPrecedence.clear();
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+}
+
+// Operators whose definition failed in codegen. With -pipeline that runs on
+// another thread, so the parser drops them itself before its next lookup.
+static std::mutex FailedOperatorsMutex;
+static std::vector<char> FailedOperators;
+static std::atomic<bool> HaveFailedOperators(false);
+
+
+/// ForgetOperator - undo the precedence ParseDefinition installed for Op.
+/// Safe to call from any thread.
+static void ForgetOperator(char Op) {
+    std::lock_guard<std::mutex> Lock(FailedOperatorsMutex);
+    FailedOperators.push_back(Op);
+    HaveFailedOperators.store(true, std::memory_order_release);
+}
+
+
 static int GetTokPrecedence() {
     if(!isascii(CurTok))
         return -1;
 
+    if(HaveFailedOperators.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> Lock(FailedOperatorsMutex);
+        for(char Op : FailedOperators)
+            BinopPrecedence.erase(Op);
+        FailedOperators.clear();
+        HaveFailedOperators.store(false, std::memory_order_relaxed);
+    }
+
     int TokPrec = BinopPrecedence[CurTok];
     if(TokPrec <= 0)
         return -1;
@@ -19,8 +71,38 @@ static int GetTokPrecedence() {
 }
 
 
+static cl::opt<unsigned> ErrorLimit("ferror-limit", cl::init(20),
+                                    cl::desc("Stop after N errors (0 = no limit, the default at a terminal)"),
+                                    cl::value_desc("N"));
+
+// Bumped by the parser and, with -pipeline, by codegen on another thread.
+static std::atomic<unsigned> NumErrors(0);
+
+
+static bool ErrorLimitReached() {
+    return ErrorLimit && NumErrors >= ErrorLimit;
+}
+
+
+/// ReportError - print Str at Loc, or without a position when Loc is line 0,
+/// which is all nodes loaded from a binary AST have.
+static void ReportError(SourceLocation Loc, const char *Str) {
+    unsigned N = ++NumErrors;
+    if(ErrorLimit && N > ErrorLimit)
+        return;
+
+    if(Loc.Line)
+        fprintf(stderr, "%d:%d: error: %s\n", Loc.Line, Loc.Col, Str);
+    else
+        fprintf(stderr, "error: %s\n", Str);
+    if(ErrorLimit && N == ErrorLimit)
+        fprintf(stderr, "fatal error: too many errors emitted, stopping now [-ferror-limit=]\n");
+}
+
+
+/// LogError - a parse error, at the current token.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
+    ReportError(CurLoc, Str);
     return nullptr;
 }
 
@@ -31,13 +113,54 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
 }
 
 
+/// SynchronizeParser - after a parse error, skip to the next token that can
+/// start a top-level item, so a single mistake is reported only once.
+static void SynchronizeParser() {
+    while(CurTok != ';' && CurTok != tok_def && CurTok != tok_extern && CurTok != tok_eof)
+        getNextToken();
+}
+
+
 static std::unique_ptr<ExprAST> ParseExpression();
+static std::unique_ptr<ExprAST> ParseLoop(SourceLocation Loc, const std::string &IdName, char Reduction,
+                                          bool IsParallel);
+
+
+/// GetReductionOp - the operator that combines the values of a sum, product,
+/// min or max loop, or 0 if Name is none of those. These are not keywords:
+/// they start a loop only when the loop variable and its '=' follow.
+static char GetReductionOp(const std::string &Name) {
+    if(Name == "sum")
+        return '+';
+    if(Name == "product")
+        return '*';
+    if(Name == "min")
+        return '<';
+    if(Name == "max")
+        return '>';
+    return 0;
+}
+
+
+/// Located - E placed at Loc, usually where its first token started. Nodes
+/// never read CurLoc themselves: the AST optimizer builds them too, on the
+/// codegen thread under -pipeline.
+static std::unique_ptr<ExprAST> Located(SourceLocation Loc, std::unique_ptr<ExprAST> E) {
+    E->setLoc(Loc);
+    return E;
+}
 
 
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+    if(NumError)
+        return LogError(NumError);
+
+    // An integer literal can meet an integer operand as an i64, but only
+    // while its double payload holds it exactly.
+    bool IsInt = NumIsInteger && NumVal <= 9007199254740992.0;
+    auto Result = Located(CurLoc, std::make_unique<NumberExprAST>(NumVal, IsInt));
     getNextToken();
-    return std::move(Result);
+    return Result;
 }
 
 
@@ -56,40 +179,85 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 }
 
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
-
-    getNextToken();
-
-    if(CurTok != '(') 
-        return std::make_unique<VariableExprAST>(IdName);
-
+/// ParseCallArgs - the argument list of a call, from the '(' on.
+static bool ParseCallArgs(std::vector<std::unique_ptr<ExprAST>> &Args) {
     getNextToken();
-    std::vector<std::unique_ptr<ExprAST>> Args;
     if(CurTok != ')') {
         while(true) {
             if(auto Arg = ParseExpression())
                 Args.push_back(std::move(Arg));
             else
-                return nullptr;
+                return false;
 
             if(CurTok == ')') 
                 break;
 
-            if(CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
+            if(CurTok != ',') {
+                LogError("Expected ')' or ',' in argument list");
+                return false;
+            }
+
+            getNextToken();
+        }
+    }
+
+    getNextToken();
+    return true;
+}
+
+
+static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
+    std::string IdName = IdentifierStr;
+    SourceLocation Loc = CurLoc;
+
+    getNextToken();
 
+    if(CurTok == tok_indentifier && PeekToken() == '=') {
+        if(char Reduction = GetReductionOp(IdName)) {
+            std::string VarName = IdentifierStr;
             getNextToken();
+            return ParseLoop(Loc, VarName, Reduction, false);
         }
     }
 
+    if(CurTok != '(') 
+        return Located(Loc, std::make_unique<VariableExprAST>(IdName));
+
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    if(!ParseCallArgs(Args))
+        return nullptr;
+
+    return Located(Loc, std::make_unique<CallExprAST>(IdName, std::move(Args)));
+}
+
+
+/// SawAwait - whether the definition being parsed awaits, which makes it
+/// async.
+static bool SawAwait = false;
+
+
+static std::unique_ptr<ExprAST> ParseAwaitExpr() {
+    SourceLocation Loc = CurLoc;
+    getNextToken();
+
+    if(CurTok != tok_indentifier)
+        return LogError("expected a call after await");
+    std::string Callee = IdentifierStr;
     getNextToken();
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    if(CurTok != '(')
+        return LogError("expected a call after await");
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    if(!ParseCallArgs(Args))
+        return nullptr;
+
+    SawAwait = true;
+    return Located(Loc, std::make_unique<AwaitExprAST>(Callee, std::move(Args)));
 }
 
 
 static std::unique_ptr<ExprAST> ParseIfExpr() {
+    SourceLocation Loc = CurLoc;
     getNextToken();
 
     auto Cond = ParseExpression();
@@ -112,11 +280,15 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
     if(!Else)
         return nullptr;
 
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    return Located(Loc, std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else)));
 }
 
 
+/// ParseForExpr - for and parfor loops. A parfor may name a reduction,
+/// as in "parfor max i = ...", and otherwise sums.
 static std::unique_ptr<ExprAST> ParseForExpr() {
+    SourceLocation Loc = CurLoc;
+    bool IsParallel = CurTok != tok_for; // parfor, a contextual keyword
     getNextToken();
 
     if(CurTok != tok_indentifier)
@@ -124,6 +296,22 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     std::string IdName = IdentifierStr;
     getNextToken();
 
+    char Reduction = IsParallel ? '+' : 0;
+    if(IsParallel && CurTok == tok_indentifier && PeekToken() == '=' && GetReductionOp(IdName)) {
+        Reduction = GetReductionOp(IdName);
+        IdName = IdentifierStr;
+        getNextToken();
+    }
+    return ParseLoop(Loc, IdName, Reduction, IsParallel);
+}
+
+
+/// ParseLoop - the rest of a loop, from the '=' after its variable. The end
+/// of a reduction is a bound rather than a condition: its body runs for
+/// each of start, start + step, ... short of end, and the loop combines
+/// the results with Reduction.
+static std::unique_ptr<ExprAST> ParseLoop(SourceLocation Loc, const std::string &IdName, char Reduction,
+                                          bool IsParallel) {
     if(CurTok != '=')
         return LogError("expected '=' after for");
     getNextToken();
@@ -156,11 +344,13 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if(!Body)
         return nullptr;
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+    return Located(Loc, std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step),
+                                                     std::move(Body), Reduction, IsParallel));
 }
 
 
 static std::unique_ptr<ExprAST> ParseVarExpr() {
+    SourceLocation Loc = CurLoc;
     getNextToken();
 
     std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
@@ -198,7 +388,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     if(!Body)
         return nullptr;
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return Located(Loc, std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body)));
 }
 
 
@@ -207,6 +397,10 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
         default:
             return LogError("unknown token when expecting an expression");
         case tok_indentifier:
+            if(AtContextualKeyword("parfor"))
+                return ParseForExpr();
+            if(AtContextualKeyword("await"))
+                return ParseAwaitExpr();
             return ParseIdentifierExpr();
         case tok_number:
             return ParseNumberExpr();
@@ -227,9 +421,10 @@ static std::unique_ptr<ExprAST> ParseUnary() {
         return ParsePrimary();
 
     int Opc = CurTok;
+    SourceLocation Loc = CurLoc;
     getNextToken();
     if(auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+        return Located(Loc, std::make_unique<UnaryExprAST>(Opc, std::move(Operand)));
     else
         return nullptr;
 }
@@ -243,6 +438,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
             return LHS;
 
         int BinOp = CurTok;
+        SourceLocation BinLoc = CurLoc;
         getNextToken();
 
         auto RHS = ParseUnary();
@@ -256,7 +452,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
                 return nullptr;
         }
         
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        LHS = Located(BinLoc, std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS)));
     }
 }
 
@@ -270,8 +466,27 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 
+static bool ParseTypeName(ExprType &Ty) {
+    if(CurTok != tok_indentifier)
+        return false;
+
+    if(IdentifierStr == "double")
+        Ty = type_double;
+    else if(IdentifierStr == "int")
+        Ty = type_int;
+    else if(IdentifierStr == "bool")
+        Ty = type_bool;
+    else
+        return false;
+
+    getNextToken();
+    return true;
+}
+
+
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
     std::string FnName;
+    SourceLocation FnLoc = CurLoc;
 
     unsigned Kind = 0;  // 0 = identifier, 1 = unary, 2 = binary.
     unsigned BinaryPrecedence = 30;
@@ -314,8 +529,19 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         return LogErrorP("Expected '(' in prototype");
 
     std::vector<std::string> ArgNames;
-    while(getNextToken() == tok_indentifier)
-        ArgNames.push_back(IndentifierStr);
+    std::vector<ExprType> ArgTypes;
+    getNextToken();
+    while(CurTok == tok_indentifier) {
+        ArgNames.push_back(IdentifierStr);
+        ArgTypes.push_back(type_double);
+        getNextToken();
+
+        if(CurTok == ':') {
+            getNextToken();
+            if(!ParseTypeName(ArgTypes.back()))
+                return LogErrorP("Expected type name after ':' in prototype");
+        }
+    }
 
     if(CurTok != ')')
         return LogErrorP("Expected ')' in prototype");
@@ -323,30 +549,83 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     // parse successfully
     getNextToken();
 
+    ExprType RetType = type_double;
+    if(CurTok == ':') {
+        getNextToken();
+        if(!ParseTypeName(RetType))
+            return LogErrorP("Expected return type after ':' in prototype");
+    }
+
     if(Kind && ArgNames.size() != Kind)
         return LogErrorP("Expected ')' in prototype");
 
-    return std::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0, BinaryPrecedence);
+    auto Proto = std::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0, BinaryPrecedence,
+                                                std::move(ArgTypes), RetType);
+    Proto->setLoc(FnLoc);
+    return Proto;
+}
+
+
+/// CheckMemoEffects - whether a memo function with effects Effects may
+/// cache its results. If not, report why at Loc: it awaits, or Culprit is
+/// the first callee that may have side effects.
+static bool CheckMemoEffects(SourceLocation Loc, const FunctionEffects &Effects, bool IsAsync,
+                             const std::string &Culprit) {
+    if(Effects.Pure)
+        return true;
+    if(IsAsync)
+        ReportError(Loc, "memo function cannot await");
+    else
+        ReportError(Loc, ("memo function calls '" + Culprit + "', which may have side effects").c_str());
+    return false;
 }
 
 
 static std::unique_ptr<FunctionAST> ParseDefinition() {
     getNextToken();
+    bool IsMemo = AtContextualKeyword("memo");
+    if(IsMemo)
+        getNextToken();
+
+    SourceLocation FnLoc = CurLoc;
     auto Proto = ParsePrototype();
 
     if(!Proto)
         return nullptr;
 
-    if(auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    else
+    // Install the operator now rather than at codegen, which may run on
+    // another thread after the parser has moved on.
+    char BinaryOp = Proto->isBinaryOp() ? Proto->getOperatorName() : 0;
+    if(BinaryOp)
+        BinopPrecedence[BinaryOp] = Proto->getBinaryPrecedence();
+
+    SawAwait = false;
+    if(auto E = ParseExpression()) {
+        Proto->setAsync(SawAwait);
+        auto Fn = std::make_unique<FunctionAST>(std::move(Proto), std::move(E), IsMemo);
+        std::string Culprit;
+        auto &Effects = Fn->analyzeEffects(Culprit);
+        if(!IsMemo || CheckMemoEffects(FnLoc, Effects, SawAwait, Culprit))
+            return Fn;
+
+        if(BinaryOp)
+            BinopPrecedence.erase(BinaryOp);
         return nullptr;
+    }
+
+    if(BinaryOp)
+        BinopPrecedence.erase(BinaryOp);
+    return nullptr;
 }
 
 
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+    SourceLocation Loc = CurLoc;
+    SawAwait = false;
     if(auto E = ParseExpression()) {
         auto Proto = make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+        Proto->setLoc(Loc);
+        Proto->setAsync(SawAwait);
         return make_unique<FunctionAST>(std::move(Proto), std::move(E));
     }
     else
@@ -354,7 +633,18 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 }
 
 
+/// ParseExtern - "extern name(args)", or "extern async name(args)" for a
+/// host function that returns a future.
 static std::unique_ptr<PrototypeAST> ParseExtern() {
     getNextToken();
-    return ParsePrototype();   
+    bool IsAsync = AtContextualKeyword("async");
+    if(IsAsync)
+        getNextToken();
+
+    auto Proto = ParsePrototype();
+    if(Proto) {
+        Proto->setAsync(IsAsync);
+        Proto->forgetEffects();
+    }
+    return Proto;
 }
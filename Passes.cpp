@@ -0,0 +1,92 @@
+static cl::opt<char> OptLevel("O", cl::Prefix, cl::ZeroOrMore, cl::init('0'),
+                              cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O0')"));
+
+
+/// RunPassPipeline - run the standard pipeline for Level over M. TM supplies
+/// the cost model the vectorizers need. With LTOPreLink the module only gets
+/// the pre-link half, leaving inlining across languages and the late loop
+/// passes to the link step.
+static void RunPassPipeline(Module &M, TargetMachine *TM, OptimizationLevel Level,
+                            bool LTOPreLink = false) {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM = LTOPreLink ? PB.buildLTOPreLinkDefaultPipeline(Level)
+                                       : PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+}
+
+
+static cl::list<std::string> ExportList("export", cl::CommaSeparated,
+                                        cl::desc("Keep only these functions visible outside the output"),
+                                        cl::value_desc("name,..."));
+
+
+/// InternalizeModule - with -export, make every other definition in M
+/// internal, so the optimizer may inline it everywhere, drop it once unused
+/// and change its signature.
+static void InternalizeModule(Module &M) {
+    if(ExportList.empty())
+        return;
+
+    std::set<std::string> Exports(ExportList.begin(), ExportList.end());
+    internalizeModule(M, [&](const GlobalValue &GV) { return Exports.count(GV.getName().str()) != 0; });
+}
+
+
+/// LowerCoroutines - split async functions into their ramp and resume parts,
+/// which every pipeline above does as well. Code generation cannot handle
+/// the coroutine intrinsics, so -O0 needs this much.
+static void LowerCoroutines(Module &M) {
+    if(!M.getFunction("llvm.coro.begin"))
+        return;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    MPM.addPass(createModuleToFunctionPassAdaptor(CoroEarlyPass()));
+    MPM.addPass(createModuleToPostOrderCGSCCPassAdaptor(CoroSplitPass()));
+    MPM.addPass(createModuleToFunctionPassAdaptor(CoroCleanupPass()));
+    MPM.run(M, MAM);
+}
+
+
+/// OptimizeModule - optimize M as requested by -O<n>.
+static void OptimizeModule(Module &M, TargetMachine *TM, bool LTOPreLink = false) {
+    switch(OptLevel) {
+        case '0':
+            LowerCoroutines(M);
+            return;
+        case '1':
+            RunPassPipeline(M, TM, OptimizationLevel::O1, LTOPreLink);
+            return;
+        case '2':
+            RunPassPipeline(M, TM, OptimizationLevel::O2, LTOPreLink);
+            return;
+        case '3':
+            RunPassPipeline(M, TM, OptimizationLevel::O3, LTOPreLink);
+            return;
+        default:
+            errs() << "Invalid optimization level -O" << OptLevel << "\n";
+            return;
+    }
+}
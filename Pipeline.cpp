@@ -0,0 +1,262 @@
+static cl::opt<bool> Pipeline("pipeline",
+                              cl::desc("Parse, generate code and emit objects concurrently, one chunk at a time"));
+static cl::opt<unsigned> ChunkSize("chunk-size", cl::init(64),
+                                   cl::desc("Functions per module chunk handed to the backend with -pipeline"),
+                                   cl::value_desc("N"));
+static cl::opt<unsigned> QueueDepth("queue-depth", cl::init(256),
+                                    cl::desc("Parsed functions allowed to wait for codegen with -pipeline"),
+                                    cl::value_desc("N"));
+
+
+/// BoundedQueue - a fixed-capacity queue between two pipeline stages. push
+/// blocks while the queue is full and pop while it is empty; once the queue
+/// is closed and drained, pop returns false. Once the consumers abandon it,
+/// push drops its item and returns false.
+template <typename T>
+class BoundedQueue {
+    std::mutex Mutex;
+    std::condition_variable NotEmpty, NotFull;
+    std::deque<T> Items;
+    size_t Capacity;
+    bool Closed = false;
+    bool Abandoned = false;
+
+public:
+    explicit BoundedQueue(size_t Capacity) : Capacity(Capacity ? Capacity : 1) {}
+
+    bool push(T Item) {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        NotFull.wait(Lock, [this] { return Items.size() < Capacity || Abandoned; });
+        if(Abandoned)
+            return false;
+        Items.push_back(std::move(Item));
+        NotEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T &Item) {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        NotEmpty.wait(Lock, [this] { return !Items.empty() || Closed; });
+        if(Items.empty())
+            return false;
+        Item = std::move(Items.front());
+        Items.pop_front();
+        NotFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Closed = true;
+        NotEmpty.notify_all();
+    }
+
+    /// abandon - nothing will pop any more; release the producers.
+    void abandon() {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Abandoned = true;
+        NotFull.notify_all();
+    }
+};
+
+
+/// ParsedItem - what the parser hands to codegen: a def or top-level
+/// expression in Fn, or an extern in Proto.
+struct ParsedItem {
+    std::unique_ptr<FunctionAST> Fn;
+    std::unique_ptr<PrototypeAST> Proto;
+};
+
+
+/// ModuleChunk - a finished module and the context that owns it. The module
+/// is declared last so it is destroyed first.
+struct ModuleChunk {
+    unsigned Index;
+    std::unique_ptr<LLVMContext> Context;
+    std::unique_ptr<Module> M;
+};
+
+
+/// ParseInput - the first stage. The lexer and parser run on their own
+/// thread, so this is the only code touching them until it returns.
+static void ParseInput(BoundedQueue<ParsedItem> &Out) {
+    getNextToken();
+    while(true) {
+        ParsedItem Item;
+        if(ErrorLimitReached())
+            CurTok = tok_eof;
+
+        switch(CurTok) {
+            case tok_eof:
+                Out.close();
+                return;
+            case ';':
+                getNextToken();
+                continue;
+            case tok_def:
+                Item.Fn = ParseDefinition();
+                break;
+            case tok_extern:
+                Item.Proto = ParseExtern();
+                break;
+            default:
+                Item.Fn = ParseTopLevelExpr();
+                break;
+        }
+
+        if(!Item.Fn && !Item.Proto)
+            SynchronizeParser();
+        else if(!Out.push(std::move(Item)))
+            return;
+    }
+}
+
+
+static ModuleChunk TakeChunk(unsigned Index, TargetMachine *TM) {
+    FinalizeDebugInfo();
+
+    // Later chunks may call the user's definitions, so those stay external.
+    // Everything else is the chunk's own, as with -export: the helpers
+    // codegen made, and the top-level expression every chunk has.
+    internalizeModule(*TheModule, [](const GlobalValue &GV) {
+        return GV.getName() != "__anon_expr" && FunctionProtos.count(GV.getName().str()) != 0;
+    });
+
+    ModuleChunk Chunk{Index, std::move(TheContext), std::move(TheModule)};
+    InitializeModuleAndPassManager();
+    TheModule->setTargetTriple(TM->getTargetTriple().str());
+    TheModule->setDataLayout(TM->createDataLayout());
+    return Chunk;
+}
+
+
+/// GenerateChunks - the second stage: optimize and codegen each parsed item,
+/// starting a new module every -chunk-size functions. If the backends are
+/// all gone, the parser is told to stop too.
+static void GenerateChunks(BoundedQueue<ParsedItem> &In, BoundedQueue<ModuleChunk> &Out, TargetMachine *TM) {
+    unsigned NumChunks = 0, InChunk = 0;
+    InitializeModuleAndPassManager();
+    TheModule->setTargetTriple(TM->getTargetTriple().str());
+    TheModule->setDataLayout(TM->createDataLayout());
+
+    ParsedItem Item;
+    while(In.pop(Item)) {
+        if(Item.Proto) {
+            FunctionProtos[Item.Proto->getName()] = std::move(Item.Proto);
+            continue;
+        }
+
+        Item.Fn->optimize();
+        if(!Item.Fn->codegen())
+            continue;
+
+        if(++InChunk == ChunkSize) {
+            if(!Out.push(TakeChunk(NumChunks++, TM))) {
+                In.abandon();
+                return;
+            }
+            InChunk = 0;
+        }
+    }
+
+    if(InChunk)
+        Out.push(TakeChunk(NumChunks++, TM));
+    Out.close();
+}
+
+
+/// EmitChunks - the third stage, run on each of the -j backend threads.
+/// Objects are filed by chunk index so the link order matches the input.
+static bool EmitChunks(BoundedQueue<ModuleChunk> &In, std::vector<std::string> &Parts, std::mutex &PartsMutex) {
+    std::string Error;
+    auto TM = CreateTargetMachine(sys::getDefaultTargetTriple(), Error);
+    if(!TM) {
+        errs() << Error;
+        return false;
+    }
+
+    bool OK = true;
+    ModuleChunk Next;
+    while(In.pop(Next)) {
+        // Move out of Next so this chunk is torn down, module first, before
+        // the next pop assigns over it.
+        ModuleChunk Chunk = std::move(Next);
+        if(EmitPIC)
+            Chunk.M->setPICLevel(PICLevel::BigPIC);
+        OptimizeModule(*Chunk.M, TM.get());
+
+        SmallString<128> Path;
+        if(auto EC = sys::fs::createTemporaryFile("kaleidoscope-chunk", "o", Path)) {
+            errs() << "Could not create temporary file: " << EC.message();
+            OK = false;
+            continue;
+        }
+        OK &= EmitFile(*Chunk.M, TM.get(), out_obj, Path);
+
+        std::lock_guard<std::mutex> Lock(PartsMutex);
+        if(Parts.size() <= Chunk.Index)
+            Parts.resize(Chunk.Index + 1);
+        Parts[Chunk.Index] = std::string(Path.str());
+    }
+    return OK;
+}
+
+
+/// RunPipeline - compile stdin to one object file with parsing, codegen and
+/// the backend overlapped. Cross-chunk inlining is given up in exchange.
+static bool RunPipeline() {
+    auto Kinds = GetOutputKinds();
+    if(Kinds.size() != 1 || Kinds[0] != out_obj || EmitShared) {
+        errs() << "-pipeline only writes a single object file\n";
+        return false;
+    }
+    if(!ExportList.empty()) {
+        errs() << "-export needs the whole program in one module, which -pipeline does not build\n";
+        return false;
+    }
+
+    std::string Error;
+    auto TM = CreateTargetMachine(sys::getDefaultTargetTriple(), Error);
+    if(!TM) {
+        errs() << Error;
+        return false;
+    }
+
+    BoundedQueue<ParsedItem> Parsed(QueueDepth);
+    BoundedQueue<ModuleChunk> Chunks(CodegenThreads);
+    std::vector<std::string> Parts;
+    std::mutex PartsMutex;
+
+    std::thread Parser(ParseInput, std::ref(Parsed));
+
+    std::vector<std::thread> Backends;
+    std::vector<char> BackendOK(std::max(1u, (unsigned)CodegenThreads));
+    std::atomic<unsigned> LiveBackends(BackendOK.size());
+    for(unsigned i = 0; i != BackendOK.size(); ++i)
+        Backends.emplace_back([&, i] {
+            BackendOK[i] = EmitChunks(Chunks, Parts, PartsMutex);
+            // Backends only leave early on failure; the last one out must
+            // not leave codegen blocked on a full queue.
+            if(--LiveBackends == 0)
+                Chunks.abandon();
+        });
+
+    GenerateChunks(Parsed, Chunks, TM.get());
+
+    Parser.join();
+    for(auto &T : Backends)
+        T.join();
+
+    PrintASTOptStatistics();
+
+    bool OK = !NumErrors && std::all_of(BackendOK.begin(), BackendOK.end(), [](char B) { return B; });
+    std::string Filename = GetOutputFilename(out_obj, true);
+    if(OK)
+        OK = Parts.empty() ? EmitFile(*TheModule, TM.get(), out_obj, Filename) : LinkRelocatable(Parts, Filename);
+
+    for(auto &Part : Parts)
+        sys::fs::remove(Part);
+    if(OK)
+        outs() << "Wrote " << Filename << "\n";
+    return OK;
+}
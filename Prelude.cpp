@@ -0,0 +1,126 @@
+static cl::opt<bool> EmitPrelude("emit-prelude",
+                                 cl::desc("Write the object file as a prelude snapshot for -prelude"));
+static cl::opt<std::string> PreludeFile("prelude", cl::desc("Load a prelude snapshot before reading input"),
+                                        cl::value_desc("filename"));
+
+
+// A prelude snapshot is an ordinary object file. Its prototypes travel with
+// it as extern declarations in this section, which the loader feeds back
+// through the parser.
+static const char *PreludeSectionName = ".kaleidoscope_prelude";
+
+
+static const char *GetTypeName(ExprType Ty) {
+    switch(Ty) {
+        case type_int:
+            return "int";
+        case type_bool:
+            return "bool";
+        default:
+            return "double";
+    }
+}
+
+
+/// GetPrototypeSource - P as an extern the parser reads back unchanged.
+static std::string GetPrototypeSource(const PrototypeAST &P) {
+    std::string Source = P.isAsync() ? "extern async " : "extern ";
+    if(P.isBinaryOp())
+        Source += "binary" + std::string(1, P.getOperatorName()) + " " + std::to_string(P.getBinaryPrecedence());
+    else if(P.isUnaryOp())
+        Source += "unary" + std::string(1, P.getOperatorName());
+    else
+        Source += P.getName();
+
+    Source += "(";
+    for(unsigned i = 0, e = P.getArgs().size(); i != e; ++i) {
+        Source += (i ? " " : "") + P.getArgs()[i];
+        if(P.getArgType(i) != type_double)
+            Source += std::string(":") + GetTypeName(P.getArgType(i));
+    }
+    Source += ")";
+    if(P.getReturnType() != type_double)
+        Source += std::string(" : ") + GetTypeName(P.getReturnType());
+    return Source + ";\n";
+}
+
+
+/// AddPrototypeTable - record every known prototype in M's prelude section.
+/// Top-level expressions are made internal so they cannot clash with the
+/// loading program's own.
+static void AddPrototypeTable(Module &M) {
+    if(auto *Anon = M.getFunction("__anon_expr"))
+        Anon->setLinkage(Function::InternalLinkage);
+
+    std::string Table;
+    for(auto &Entry : FunctionProtos)
+        if(Entry.first != "__anon_expr")
+            Table += GetPrototypeSource(*Entry.second);
+
+    auto *Init = ConstantDataArray::getString(M.getContext(), Table, false);
+    auto *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init,
+                                  "kaleidoscope.prelude");
+    GV->setSection(PreludeSectionName);
+    GV->setAlignment(Align(1));
+    appendToUsed(M, {GV});
+}
+
+
+/// LoadPrelude - register the prototypes and operators of -prelude. In the
+/// JIT its object code is added as is, so nothing is parsed or compiled
+/// again; ahead of time the snapshot is linked with the output like any
+/// other object.
+static bool LoadPrelude() {
+    auto Buffer = MemoryBuffer::getFile(PreludeFile);
+    if(!Buffer) {
+        errs() << "Could not open " << PreludeFile << ": " << Buffer.getError().message() << "\n";
+        return false;
+    }
+
+    auto Obj = object::ObjectFile::createObjectFile((*Buffer)->getMemBufferRef());
+    if(!Obj) {
+        logAllUnhandledErrors(Obj.takeError(), errs(), PreludeFile + ": ");
+        return false;
+    }
+
+    StringRef Table;
+    for(auto &Section : (*Obj)->sections()) {
+        auto Name = Section.getName();
+        if(Name && *Name == PreludeSectionName) {
+            if(auto Contents = Section.getContents())
+                Table = *Contents;
+            else
+                consumeError(Contents.takeError());
+        } else if(!Name) {
+            consumeError(Name.takeError());
+        }
+    }
+    if(Table.empty()) {
+        errs() << PreludeFile << " is not a prelude snapshot\n";
+        return false;
+    }
+
+    SetLexerInput(Table.begin(), Table.end());
+    getNextToken();
+    while(CurTok == tok_extern) {
+        auto Proto = ParseExtern();
+        if(!Proto)
+            break;
+        if(Proto->isBinaryOp())
+            BinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+        FunctionProtos[Proto->getName()] = std::move(Proto);
+        if(CurTok == ';')
+            getNextToken();
+    }
+    bool OK = CurTok == tok_eof;
+    SetLexerInput(nullptr, nullptr);
+
+    if(!OK) {
+        errs() << PreludeFile << ": malformed prototype table\n";
+        return false;
+    }
+
+    if(TheJIT)
+        return !LogJITError(TheJIT->addObjectFile(std::move(*Buffer)));
+    return true;
+}
@@ -1,62 +1,98 @@
-int main() {
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
 
-    fprintf(stderr, ">>> ");
-    getNextToken();
+    InstallBuiltinOperators();
 
-    MainLoop();
+    // Typing at a prompt, a run of mistakes should not end the session.
+    if(!ErrorLimit.getNumOccurrences() && sys::Process::StandardInIsUserInput())
+        ErrorLimit = 0;
 
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
+    if(!UseJIT && !CheckOutputOptions())
+        return 1;
 
-    auto TargetTriple = sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
+    if(!ProfileUse.empty() && !LoadProfile())
+        return 1;
 
-    std::string Error;
-    auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if(UseJIT && !InitializeJIT())
+        return 1;
 
-    if(!Target) {
-        errs() << Error;
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    if(!PreludeFile.empty() && !LoadPrelude())
         return 1;
+
+    if(BenchLexer)
+        return BenchmarkLexer() ? 0 : 1;
+
+    // Outside the JIT, which evaluates each line as it arrives, read the
+    // input whole so the lexer can scan it in place.
+    std::unique_ptr<MemoryBuffer> Input;
+    if(!UseJIT && LoadASTFile.empty() && !sys::Process::StandardInIsUserInput()) {
+        auto Buffer = MemoryBuffer::getSTDIN();
+        if(!Buffer) {
+            errs() << "Could not read stdin: " << Buffer.getError().message() << "\n";
+            return 1;
+        }
+        Input = std::move(*Buffer);
+        SetLexerInput(Input->getBufferStart(), Input->getBufferEnd());
     }
 
-    auto CPU = "generic";
-    auto Features = "";
+    if(!EmitASTFile.empty())
+        return WriteASTFile(EmitASTFile) ? 0 : 1;
 
-    TargetOption opt;
-    auto RM = Optional<Reloc::Model>();
-    auto TheTargetMachine =
-        Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+    if(BenchASTWalks)
+        return BenchmarkASTWalks() ? 0 : 1;
 
-    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    if(Pipeline)
+        return RunPipeline() ? 0 : 1;
 
-    auto Filename = "output.o";
-    std::error_code EC;
-    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    InitializeModuleAndPassManager();
 
-    if(EC) {
-        errs() << "Could not open file: " << EC.message();
-        return 1;
+    if(!LoadASTFile.empty()) {
+        if(!(UseFlatAST ? CodegenFlatASTFile(LoadASTFile) : CodegenASTFile(LoadASTFile)))
+            return 1;
+    } else {
+        fprintf(stderr, ">>> ");
+        getNextToken();
+
+        MainLoop();
     }
 
-    legacy::PassManager pass;
-    auto FileType = CGFT_ObjectFile;
+    PrintASTOptStatistics();
 
-    if(TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-        errs() << "TheTargetMachine can't emit a file of this type";
+    if(NumErrors) {
+        fprintf(stderr, "%u error%s generated.\n", NumErrors.load(), NumErrors == 1 ? "" : "s");
+        if(!UseJIT)
+            return 1;
+    }
+
+    if(UseJIT)
+        return 0;
+
+    auto TargetTriple = sys::getDefaultTargetTriple();
+    TheModule->setTargetTriple(TargetTriple);
+
+    std::string Error;
+    auto TheTargetMachine = CreateTargetMachine(TargetTriple, Error);
+
+    if(!TheTargetMachine) {
+        errs() << Error;
         return 1;
     }
 
-    pass.run(*TheModule);
-    dest.flush();
+    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    FinalizeDebugInfo();
+
+    if(EmitPrelude)
+        AddPrototypeTable(*TheModule);
+    InternalizeModule(*TheModule);
+
+    OptimizeModule(*TheModule, TheTargetMachine.get(), EmitLTO);
 
-    outs() << "Wrote " << Filename << "\n";
+    if(!EmitOutputs(*TheModule, TheTargetMachine.get()))
+        return 1;
 
     return 0;
 }
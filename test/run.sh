@@ -0,0 +1,82 @@
+#!/bin/sh
+# run.sh - run the regression tests against a built compiler.
+#
+#   test/run.sh path/to/toy [test.ks...]
+#
+# Each test is a Kaleidoscope file whose comments say how to run it and what
+# it must print, in the manner of LLVM's lit and FileCheck:
+#
+#   # RUN: %toy -jit < %s
+#   # CHECK: Evaluated to 3.000000
+#
+# Every RUN line is a shell command, with %toy replaced by the compiler, %s by
+# the test file and %t by a scratch path for the test. Their combined stdout
+# and stderr must contain each CHECK line, in order, as a substring of one
+# line of output. kast_patch is available to RUN lines to corrupt binary ASTs.
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 path/to/toy [test.ks...]" >&2
+    exit 2
+fi
+
+Toy=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+if [ ! -x "$Toy" ]; then
+    echo "$0: $Toy is not an executable" >&2
+    exit 2
+fi
+
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/*.ks
+fi
+
+Scratch=$(mktemp -d "${TMPDIR:-/tmp}/kaleidoscope-test.XXXXXX") || exit 2
+trap 'rm -rf "$Scratch"' EXIT
+
+# kast_patch FILE node|func INDEX OFFSET VALUE - set the byte at OFFSET in
+# node or function record INDEX of the binary AST FILE to VALUE. The layout
+# is ASTFileHeader's: ten 32-bit words, then 8-byte constants, 16-byte nodes
+# and 24-byte functions.
+kast_patch() {
+    NumConstants=$(od -An -tu4 -j8 -N4 "$1" | tr -d ' ')
+    NumNodes=$(od -An -tu4 -j12 -N4 "$1" | tr -d ' ')
+    Record=$((40 + 8 * NumConstants))
+    if [ "$2" = func ]; then
+        Record=$((Record + 16 * NumNodes + 24 * $3))
+    else
+        Record=$((Record + 16 * $3))
+    fi
+    printf "\\$(printf '%03o' "$5")" | dd of="$1" bs=1 seek=$((Record + $4)) conv=notrunc 2>/dev/null
+}
+
+Failed=0
+for Test in "$@"; do
+    Name=$(basename "$Test" .ks)
+    Output="$Scratch/$Name.out"
+    : > "$Output"
+
+    sed -n 's/^# RUN: //p' "$Test" > "$Scratch/$Name.run"
+    while IFS= read -r Command; do
+        Command=$(printf '%s\n' "$Command" | sed -e "s|%toy|\"$Toy\"|g" -e "s|%s|\"$Test\"|g" \
+                                                 -e "s|%t|\"$Scratch/$Name\"|g")
+        (eval "$Command") < /dev/null >> "$Output" 2>&1
+    done < "$Scratch/$Name.run"
+
+    sed -n 's/^# CHECK: //p' "$Test" > "$Scratch/$Name.check"
+    if Missing=$(awk -v Checks="$Scratch/$Name.check" '
+            BEGIN { while((getline Line < Checks) > 0) { Want[N] = Line; N++ } }
+            I < N && index($0, Want[I]) { I++ }
+            END { if(I < N) { print Want[I]; exit 1 } }' "$Output"); then
+        echo "PASS: $Name"
+    else
+        echo "FAIL: $Name: expected \"$Missing\" in:"
+        sed 's/^/    /' "$Output"
+        Failed=$((Failed + 1))
+    fi
+done
+
+if [ $Failed -ne 0 ]; then
+    echo "$Failed of $# tests failed"
+    exit 1
+fi
+echo "All $# tests passed"